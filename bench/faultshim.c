@@ -0,0 +1,438 @@
+// LD_PRELOAD shim that makes a local directory behave like a slow or dead network filesystem,
+// for benchmarking haread-fs. Only calls on paths under HAREAD_FAULT_PATH, and on fds opened
+// there, are affected. Configured from the environment:
+//
+//   HAREAD_FAULT_PATH=/dir        directory to affect (required, otherwise nothing happens)
+//   HAREAD_FAULT_DELAY_US=N       add N microseconds to every call
+//   HAREAD_FAULT_JITTER_US=N      plus a random 0..N microseconds
+//   HAREAD_FAULT_ERROR_RATE=F     fail a fraction F (0..1) of the calls with EIO
+//   HAREAD_FAULT_HANG=1           never return, like a hard mounted NFS server that is gone
+//   HAREAD_FAULT_HANG_AFTER=S     only hang S seconds after startup
+//
+// io_uring calls run in the kernel, out of reach of the shim. So while any fault is configured
+// io_uring_setup fails with ENOSYS, and haread-fs -o io_engine=uring falls back to worker threads
+// whose calls the shim sees. Without faults io_uring works as usual.
+//
+// Build: cc -shared -fPIC -o faultshim.so faultshim.c -ldl
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+// Both the plain and the 64 bit calls are defined here, so they must not be renamed to each other
+#undef _FILE_OFFSET_BITS
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_FDS 65536
+
+static const char *Fault_path = NULL;
+static size_t Fault_path_len = 0;
+static long Delay_us = 0;
+static long Jitter_us = 0;
+static double Error_rate = 0;
+static int Hang = 0;
+static time_t Hang_at = 0;
+static unsigned char Faulty_fd[MAX_FDS]; // Opened under Fault_path
+static __thread unsigned int Seed = 0;
+
+static void __attribute__((constructor)) shim_init(void)
+{
+    const char *env;
+
+    Fault_path = getenv("HAREAD_FAULT_PATH");
+    if (Fault_path != NULL)
+    {
+        Fault_path_len = strlen(Fault_path);
+        while (Fault_path_len > 1 && Fault_path[Fault_path_len - 1] == '/')
+        {
+            Fault_path_len--;
+        }
+    }
+    if ((env = getenv("HAREAD_FAULT_DELAY_US")) != NULL)
+    {
+        Delay_us = atol(env);
+    }
+    if ((env = getenv("HAREAD_FAULT_JITTER_US")) != NULL)
+    {
+        Jitter_us = atol(env);
+    }
+    if ((env = getenv("HAREAD_FAULT_ERROR_RATE")) != NULL)
+    {
+        Error_rate = atof(env);
+    }
+    if ((env = getenv("HAREAD_FAULT_HANG")) != NULL)
+    {
+        Hang = atoi(env);
+    }
+    Hang_at = time(NULL);
+    if ((env = getenv("HAREAD_FAULT_HANG_AFTER")) != NULL)
+    {
+        Hang_at += atol(env);
+    }
+}
+
+static int faulty_path(const char *path)
+{
+    return Fault_path != NULL && path != NULL && strncmp(path, Fault_path, Fault_path_len) == 0 &&
+           (path[Fault_path_len] == '\0' || path[Fault_path_len] == '/');
+}
+
+static int faulty_fd(int fd)
+{
+    return fd >= 0 && fd < MAX_FDS && __atomic_load_n(&Faulty_fd[fd], __ATOMIC_RELAXED);
+}
+
+// Path relative to directory fd dirfd, as given to the *at() calls
+static int faulty_at(int dirfd, const char *path)
+{
+    if (path != NULL && path[0] == '/')
+    {
+        return faulty_path(path);
+    }
+    return faulty_fd(dirfd);
+}
+
+static int faults_configured(void)
+{
+    return Fault_path != NULL && (Delay_us > 0 || Jitter_us > 0 || Error_rate > 0 || Hang);
+}
+
+static void mark_fd(int fd, int faulty)
+{
+    if (fd >= 0 && fd < MAX_FDS)
+    {
+        __atomic_store_n(&Faulty_fd[fd], faulty, __ATOMIC_RELAXED);
+    }
+}
+
+// Delay, hang or fail. Returns -1 with errno set if the call should fail
+static int inject(void)
+{
+    if (Seed == 0)
+    {
+        Seed = (unsigned int)pthread_self() ^ (unsigned int)time(NULL);
+    }
+    if (Hang && time(NULL) >= Hang_at)
+    {
+        for (;;)
+        {
+            pause();
+        }
+    }
+    long us = Delay_us + (Jitter_us > 0 ? rand_r(&Seed) % (Jitter_us + 1) : 0);
+    if (us > 0)
+    {
+        struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        {
+            ;
+        }
+    }
+    if (Error_rate > 0 && rand_r(&Seed) < Error_rate * RAND_MAX)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+#define REAL(name, ret, ...)                                   \
+    static ret (*real)(__VA_ARGS__) = NULL;                    \
+    if (real == NULL)                                          \
+    {                                                          \
+        real = (ret(*)(__VA_ARGS__))dlsym(RTLD_NEXT, name);    \
+    }
+
+static int shim_open(const char *name, const char *path, int flags, mode_t mode)
+{
+    REAL(name, int, const char *, int, ...);
+    if (!faulty_path(path))
+    {
+        return real(path, flags, mode);
+    }
+    if (inject() == -1)
+    {
+        return -1;
+    }
+    int fd = real(path, flags, mode);
+    mark_fd(fd, 1);
+    return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (flags & O_CREAT)
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return shim_open("open", path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (flags & O_CREAT)
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return shim_open("open64", path, flags, mode);
+}
+
+int close(int fd)
+{
+    REAL("close", int, int);
+    if (faulty_fd(fd))
+    {
+        mark_fd(fd, 0);
+        if (inject() == -1)
+        {
+            real(fd); // Still closed, like NFS reporting a late error
+            return -1;
+        }
+    }
+    return real(fd);
+}
+
+static ssize_t shim_pread(const char *name, int fd, void *buf, size_t count, off_t offset)
+{
+    REAL(name, ssize_t, int, void *, size_t, off_t);
+    if (faulty_fd(fd) && inject() == -1)
+    {
+        return -1;
+    }
+    return real(fd, buf, count, offset);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    return shim_pread("pread", fd, buf, count, offset);
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+    return shim_pread("pread64", fd, buf, count, offset);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    REAL("read", ssize_t, int, void *, size_t);
+    if (faulty_fd(fd) && inject() == -1)
+    {
+        return -1;
+    }
+    return real(fd, buf, count);
+}
+
+static int shim_stat(const char *name, const char *path, void *st)
+{
+    REAL(name, int, const char *, void *);
+    if (faulty_path(path) && inject() == -1)
+    {
+        return -1;
+    }
+    return real(path, st);
+}
+
+int lstat(const char *path, struct stat *st)
+{
+    return shim_stat("lstat", path, st);
+}
+
+int lstat64(const char *path, struct stat64 *st)
+{
+    return shim_stat("lstat64", path, st);
+}
+
+int stat(const char *path, struct stat *st)
+{
+    return shim_stat("stat", path, st);
+}
+
+int stat64(const char *path, struct stat64 *st)
+{
+    return shim_stat("stat64", path, st);
+}
+
+// Older glibc only has the versioned stat entry points
+static int shim_xstat(const char *name, int ver, const char *path, void *st)
+{
+    REAL(name, int, int, const char *, void *);
+    if (faulty_path(path) && inject() == -1)
+    {
+        return -1;
+    }
+    return real(ver, path, st);
+}
+
+int __lxstat(int ver, const char *path, struct stat *st)
+{
+    return shim_xstat("__lxstat", ver, path, st);
+}
+
+int __lxstat64(int ver, const char *path, struct stat64 *st)
+{
+    return shim_xstat("__lxstat64", ver, path, st);
+}
+
+static int shim_fstat(const char *name, int fd, void *st)
+{
+    REAL(name, int, int, void *);
+    if (faulty_fd(fd) && inject() == -1)
+    {
+        return -1;
+    }
+    return real(fd, st);
+}
+
+int fstat(int fd, struct stat *st)
+{
+    return shim_fstat("fstat", fd, st);
+}
+
+int fstat64(int fd, struct stat64 *st)
+{
+    return shim_fstat("fstat64", fd, st);
+}
+
+// readdir_stat stats the entries of a listing relative to the directory's fd
+static int shim_fstatat(const char *name, int dirfd, const char *path, void *st, int flags)
+{
+    REAL(name, int, int, const char *, void *, int);
+    if (faulty_at(dirfd, path) && inject() == -1)
+    {
+        return -1;
+    }
+    return real(dirfd, path, st, flags);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+    return shim_fstatat("fstatat", dirfd, path, st, flags);
+}
+
+int fstatat64(int dirfd, const char *path, struct stat64 *st, int flags)
+{
+    return shim_fstatat("fstatat64", dirfd, path, st, flags);
+}
+
+int __fxstat(int ver, int fd, struct stat *st)
+{
+    REAL("__fxstat", int, int, int, struct stat *);
+    if (faulty_fd(fd) && inject() == -1)
+    {
+        return -1;
+    }
+    return real(ver, fd, st);
+}
+
+int __fxstat64(int ver, int fd, struct stat64 *st)
+{
+    REAL("__fxstat64", int, int, int, struct stat64 *);
+    if (faulty_fd(fd) && inject() == -1)
+    {
+        return -1;
+    }
+    return real(ver, fd, st);
+}
+
+static int shim_fxstatat(const char *name, int ver, int dirfd, const char *path, void *st, int flags)
+{
+    REAL(name, int, int, int, const char *, void *, int);
+    if (faulty_at(dirfd, path) && inject() == -1)
+    {
+        return -1;
+    }
+    return real(ver, dirfd, path, st, flags);
+}
+
+int __fxstatat(int ver, int dirfd, const char *path, struct stat *st, int flags)
+{
+    return shim_fxstatat("__fxstatat", ver, dirfd, path, st, flags);
+}
+
+int __fxstatat64(int ver, int dirfd, const char *path, struct stat64 *st, int flags)
+{
+    return shim_fxstatat("__fxstatat64", ver, dirfd, path, st, flags);
+}
+
+DIR *opendir(const char *path)
+{
+    REAL("opendir", DIR *, const char *);
+    if (faulty_path(path) && inject() == -1)
+    {
+        return NULL;
+    }
+    DIR *dp = real(path);
+    if (dp != NULL && faulty_path(path))
+    {
+        mark_fd(dirfd(dp), 1);
+    }
+    return dp;
+}
+
+static void *shim_readdir(const char *name, DIR *dp)
+{
+    REAL(name, void *, DIR *);
+    if (faulty_fd(dirfd(dp)) && inject() == -1)
+    {
+        return NULL;
+    }
+    return real(dp);
+}
+
+struct dirent *readdir(DIR *dp)
+{
+    return shim_readdir("readdir", dp);
+}
+
+struct dirent64 *readdir64(DIR *dp)
+{
+    return shim_readdir("readdir64", dp);
+}
+
+int closedir(DIR *dp)
+{
+    REAL("closedir", int, DIR *);
+    mark_fd(dirfd(dp), 0);
+    return real(dp);
+}
+
+// haread-fs makes its io_uring calls with syscall(), there is no libc wrapper for them
+long syscall(long number, ...)
+{
+    REAL("syscall", long, long, ...);
+    va_list ap;
+    long arg[6];
+
+    va_start(ap, number);
+    for (int i = 0; i < 6; i++)
+    {
+        arg[i] = va_arg(ap, long);
+    }
+    va_end(ap);
+#ifdef SYS_io_uring_setup
+    if (number == SYS_io_uring_setup && faults_configured())
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+#endif
+    return real(number, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5]);
+}
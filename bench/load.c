@@ -0,0 +1,289 @@
+// Load generator for the haread-fs benchmarks, run against a mount point by bench/run.sh.
+//
+//   load seqread FILE [BLOCK]          read FILE start to end, BLOCK bytes at a time (128 KiB)
+//   load smallfiles DIR                open, read and close every file in DIR
+//   load stat DIR [THREADS] [ROUNDS]   lstat every entry of DIR, ROUNDS times, from THREADS
+//   load readdir DIR [ROUNDS]          list DIR ROUNDS times
+//
+// Prints one line: operations, throughput, and p50/p99/max latency per operation
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct samples
+{
+    double *us;
+    size_t n;
+    size_t size;
+    unsigned long errors;
+    unsigned long long bytes;
+} samples;
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void add(samples *s, double us)
+{
+    if (s->n == s->size)
+    {
+        s->size = s->size ? s->size * 2 : 1024;
+        s->us = realloc(s->us, s->size * sizeof(double));
+        if (s->us == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->us[s->n++] = us;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const samples *s, double p)
+{
+    if (s->n == 0)
+    {
+        return 0;
+    }
+    size_t i = (size_t)(p * (s->n - 1) + 0.5);
+    return s->us[i];
+}
+
+static void report(const char *name, samples *s, double elapsed_us)
+{
+    qsort(s->us, s->n, sizeof(double), compare_double);
+    printf("%-12s ops=%-8zu ops/s=%-10.0f MB/s=%-8.1f p50_us=%-8.0f p99_us=%-8.0f max_us=%-8.0f errors=%lu\n", name, s->n,
+           s->n / (elapsed_us / 1e6), s->bytes / elapsed_us, percentile(s, 0.5), percentile(s, 0.99),
+           s->n ? s->us[s->n - 1] : 0, s->errors);
+}
+
+// Names of the entries in dir, without . and ..
+static char **list(const char *dir, size_t *n)
+{
+    DIR *dp = opendir(dir);
+    size_t size = 1024;
+    char **names = malloc(size * sizeof(char *));
+    struct dirent *de;
+
+    *n = 0;
+    if (dp == NULL)
+    {
+        perror(dir);
+        exit(1);
+    }
+    while ((de = readdir(dp)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if (*n == size)
+        {
+            size *= 2;
+            names = realloc(names, size * sizeof(char *));
+        }
+        if (asprintf(&names[(*n)++], "%s/%s", dir, de->d_name) == -1)
+        {
+            exit(1);
+        }
+    }
+    closedir(dp);
+    return names;
+}
+
+static void seqread(const char *file, size_t block)
+{
+    samples s = {0};
+    char *buf = malloc(block);
+    int fd = open(file, O_RDONLY);
+
+    if (fd == -1 || buf == NULL)
+    {
+        perror(file);
+        exit(1);
+    }
+    double start = now_us();
+    for (;;)
+    {
+        double t = now_us();
+        ssize_t n = read(fd, buf, block);
+        add(&s, now_us() - t);
+        if (n == -1)
+        {
+            s.errors++;
+            break;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        s.bytes += n;
+    }
+    report("seqread", &s, now_us() - start);
+    close(fd);
+    free(buf);
+}
+
+static void smallfiles(const char *dir)
+{
+    samples s = {0};
+    size_t n;
+    char **names = list(dir, &n);
+    char buf[65536];
+
+    double start = now_us();
+    for (size_t i = 0; i < n; i++)
+    {
+        double t = now_us();
+        int fd = open(names[i], O_RDONLY);
+        ssize_t got = -1;
+        if (fd != -1)
+        {
+            while ((got = read(fd, buf, sizeof(buf))) > 0)
+            {
+                s.bytes += got;
+            }
+            close(fd);
+        }
+        add(&s, now_us() - t);
+        if (got == -1)
+        {
+            s.errors++;
+        }
+    }
+    report("smallfiles", &s, now_us() - start);
+}
+
+typedef struct stat_worker
+{
+    char **names;
+    size_t n;
+    size_t first;
+    int rounds;
+    samples s;
+} stat_worker;
+
+static void *stat_thread(void *arg)
+{
+    stat_worker *w = arg;
+    struct stat st;
+
+    for (int r = 0; r < w->rounds; r++)
+    {
+        for (size_t i = 0; i < w->n; i++)
+        {
+            double t = now_us();
+            int res = lstat(w->names[(w->first + i) % w->n], &st);
+            add(&w->s, now_us() - t);
+            if (res == -1)
+            {
+                w->s.errors++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void statstorm(const char *dir, int threads, int rounds)
+{
+    size_t n;
+    char **names = list(dir, &n);
+    stat_worker workers[threads];
+    pthread_t ids[threads];
+    samples all = {0};
+
+    double start = now_us();
+    for (int t = 0; t < threads; t++)
+    {
+        // Each thread starts at a different place, so they do not all hit the same path at once
+        workers[t] = (stat_worker){.names = names, .n = n, .first = n * t / threads, .rounds = rounds};
+        pthread_create(&ids[t], NULL, stat_thread, &workers[t]);
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+        for (size_t i = 0; i < workers[t].s.n; i++)
+        {
+            add(&all, workers[t].s.us[i]);
+        }
+        all.errors += workers[t].s.errors;
+    }
+    report("stat", &all, now_us() - start);
+}
+
+static void listing(const char *dir, int rounds)
+{
+    samples s = {0};
+    unsigned long entries = 0;
+
+    double start = now_us();
+    for (int r = 0; r < rounds; r++)
+    {
+        double t = now_us();
+        DIR *dp = opendir(dir);
+        if (dp == NULL)
+        {
+            s.errors++;
+            add(&s, now_us() - t);
+            continue;
+        }
+        while (readdir(dp) != NULL)
+        {
+            entries++;
+        }
+        closedir(dp);
+        add(&s, now_us() - t);
+    }
+    report("readdir", &s, now_us() - start);
+    printf("%-12s entries/listing=%lu\n", "", rounds ? entries / rounds : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s seqread|smallfiles|stat|readdir PATH [args]\n", argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "seqread") == 0)
+    {
+        seqread(argv[2], argc > 3 ? (size_t)atol(argv[3]) : 131072);
+    }
+    else if (strcmp(argv[1], "smallfiles") == 0)
+    {
+        smallfiles(argv[2]);
+    }
+    else if (strcmp(argv[1], "stat") == 0)
+    {
+        statstorm(argv[2], argc > 3 ? atoi(argv[3]) : 8, argc > 4 ? atoi(argv[4]) : 10);
+    }
+    else if (strcmp(argv[1], "readdir") == 0)
+    {
+        listing(argv[2], argc > 3 ? atoi(argv[3]) : 10);
+    }
+    else
+    {
+        fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+#!/bin/sh
+# End to end benchmark: mounts haread-fs over two local directories, one of them behind the
+# fault injecting shim, and runs bench/load against the mount in each scenario.
+#
+#   BENCH_DIR=/tmp/haread-bench   where the replicas and the mount point are created
+#   BENCH_BIG_MB=512              size of the file for sequential reads
+#   BENCH_ENTRIES=100000          entries in the big directory
+#   BENCH_OPTS=                   extra -o options for haread-fs, e.g. hedge,readahead=16
+#   BENCH_TIMEOUT=300             give up on a single load run after this many seconds
+#
+# With faults configured the shim turns io_uring off, so io_engine=uring in BENCH_OPTS only takes
+# effect in the healthy scenario.
+#
+# Needs fuse (fusermount) and must be run from the top of the repo, as `make bench` does.
+set -e
+
+BENCH_DIR=${BENCH_DIR:-/tmp/haread-bench}
+BENCH_BIG_MB=${BENCH_BIG_MB:-512}
+BENCH_ENTRIES=${BENCH_ENTRIES:-100000}
+BENCH_TIMEOUT=${BENCH_TIMEOUT:-300}
+A=$BENCH_DIR/a
+B=$BENCH_DIR/b
+MNT=$BENCH_DIR/mnt
+SHIM=$(pwd)/bench/faultshim.so
+LOAD=$(pwd)/bench/load
+
+make_replica()
+{
+    if [ -f "$1/.complete" ]; then
+        return
+    fi
+    rm -rf "$1"
+    mkdir -p "$1/small" "$1/dir1k" "$1/dir100k"
+    head -c $((BENCH_BIG_MB * 1024 * 1024)) /dev/zero > "$1/big"
+    i=0
+    while [ $i -lt 1000 ]; do
+        head -c 68000 /dev/zero > "$1/small/f$i"
+        : > "$1/dir1k/e$i"
+        i=$((i + 1))
+    done
+    (cd "$1/dir100k" && seq 1 "$BENCH_ENTRIES" | sed 's/^/e/' | xargs touch)
+    touch "$1/.complete"
+}
+
+mount_haread()
+{
+    mkdir -p "$MNT"
+    opts=$BENCH_OPTS
+    env LD_PRELOAD="$SHIM" HAREAD_FAULT_PATH="$A" "$@" \
+        ./haread-fs "$A,$B" "$MNT" -f ${opts:+-o "$opts"} > "$BENCH_DIR/haread.log" 2>&1 &
+    PID=$!
+    tries=0
+    while ! mountpoint -q "$MNT"; do
+        tries=$((tries + 1))
+        if [ $tries -gt 100 ] || ! kill -0 $PID 2> /dev/null; then
+            echo "haread-fs did not mount, see $BENCH_DIR/haread.log" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+unmount_haread()
+{
+    fusermount -u "$MNT" 2> /dev/null || fusermount -uz "$MNT"
+    wait $PID || true
+}
+
+run_load()
+{
+    timeout "$BENCH_TIMEOUT" "$LOAD" "$@" || echo "$1: failed or timed out after ${BENCH_TIMEOUT}s"
+}
+
+scenario()
+{
+    name=$1
+    shift
+    echo "== $name"
+    for run in "seqread $MNT/big" "smallfiles $MNT/small" "stat $MNT/dir1k 8 10" "readdir $MNT/dir1k 100" \
+        "readdir $MNT/dir100k 3"; do
+        # A fresh mount for each run, so no run is served from the previous one's caches
+        mount_haread "$@"
+        # shellcheck disable=SC2086
+        run_load $run
+        unmount_haread
+    done
+}
+
+trap 'fusermount -uz "$MNT" 2> /dev/null || true' EXIT
+make_replica "$A"
+make_replica "$B"
+
+scenario "both replicas healthy"
+scenario "replica a slow (2 ms per call)" HAREAD_FAULT_DELAY_US=1000 HAREAD_FAULT_JITTER_US=2000
+scenario "replica a fails 5% of calls" HAREAD_FAULT_ERROR_RATE=0.05
+# Give the mount a few seconds to come up before a starts hanging
+scenario "replica a hung" HAREAD_FAULT_HANG=1 HAREAD_FAULT_HANG_AFTER=3
@@ -0,0 +1,102 @@
+// Microbenchmark for path translation: time and heap allocations per call.
+// Build and run with `make bench`
+#define main haread_main
+#include "../haread-fs.c"
+#undef main
+
+static unsigned long Allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&Allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&Allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+#define ITERATIONS 1000000
+
+// translate_path as it was, with the backend in a global and a malloc per call
+static char *Legacy_fs;
+
+static char *legacy_translate_path(const char *path)
+{
+    char *rPath = malloc(sizeof(char) * (strlen(path) + strlen(Legacy_fs) + 1));
+
+    strcpy(rPath, Legacy_fs);
+    if (rPath[strlen(rPath) - 1] == '/')
+    {
+        rPath[strlen(rPath) - 1] = '\0';
+    }
+    strcat(rPath, path);
+
+    return rPath;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, unsigned long allocs)
+{
+    printf("%-24s %8.1f ns/op %6.2f allocs/op\n", name, (now() - start) * 1e9 / ITERATIONS,
+           (double)allocs / ITERATIONS);
+}
+
+int main(void)
+{
+    static char *fss[] = {"/mnt/replica-a/", "/mnt/replica-b", NULL};
+    const char *path = "/data/model/2024/10/17/forecast_00.nc";
+    char rpath[PATH_MAX];
+    volatile size_t sink = 0;
+
+    Fss = fss;
+    Fscount = 2;
+    normalize_fss();
+    pthread_condattr_init(&Job_condattr);
+
+    unsigned long allocs = Allocs;
+    double start = now();
+    for (int n = 0; n < ITERATIONS; n++)
+    {
+        Legacy_fs = Fss[n % Fscount];
+        char *p = legacy_translate_path(path);
+        sink += p[0];
+        free(p);
+    }
+    report("legacy translate_path", start, Allocs - allocs);
+
+    allocs = Allocs;
+    start = now();
+    for (int n = 0; n < ITERATIONS; n++)
+    {
+        translate_path(n % Fscount, path, rpath);
+        sink += rpath[0];
+    }
+    report("translate_path", start, Allocs - allocs);
+
+    // What a backend call costs now, the translated path lives in the job
+    allocs = Allocs;
+    start = now();
+    for (int n = 0; n < ITERATIONS; n++)
+    {
+        backend_job *job = job_new(JOB_LSTAT, n % Fscount, path);
+        sink += job->path[0];
+        job->refs = 1;
+        job_unref(job);
+    }
+    report("job_new + job_unref", start, Allocs - allocs);
+
+    (void)sink;
+    return 0;
+}
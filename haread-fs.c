@@ -7,6 +7,9 @@
  * LICENCE : GPL v3
  */
 
+// High-level libfuse 2 API. Ops on open files and directories get their path from the handle
+// (flag_nopath), lookups, getattr, open and opendir still go by path. Not ported to the libfuse3
+// low-level API (inode table, readdirplus, clone-fd) yet
 #define FUSE_USE_VERSION 26
 
 static const char *hareadFsVersion = "2024.08.20";
@@ -17,6 +20,8 @@ static const char *hareadFsVersion = "2024.08.20";
 #include <stdio.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
@@ -25,12 +30,26 @@ static const char *hareadFsVersion = "2024.08.20";
 #include <dirent.h>
 #include <unistd.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <features.h>
 #include <signal.h>
 #include <setjmp.h>
 #include <time.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 #include <glib.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 // Debug flag
 #define DEBUG_ON 0
@@ -42,34 +61,363 @@ static const char *hareadFsVersion = "2024.08.20";
 #define DEBUG(fmt, ...) /* Nothing */
 #endif
 
-char *Currfs;
 int Fscount;
 char **Fss; // Underlying filesystems
+int *Fsprio;            // Priority tier of each of Fss, lower is tried first. From path:prio, default 1
+unsigned int *Fsweight; // Share of its tier's load. From path:prio:weight, default 1
+
+
+// Mount options, see usage()
+struct hareadfs_config
+{
+    int hedge;                // Race the read on the next replica when the pinned one is slow
+    unsigned int hedge_delay; // Milliseconds before hedging. 0 => adaptive, p95 of recent reads
+    double attr_cache_ttl;          // Seconds a cached getattr result is valid. 0 => no cache
+    double attr_cache_negative_ttl; // Seconds a path missing on all replicas is remembered
+    unsigned int attr_cache_size;   // Max cached paths
+    double entry_timeout;    // Kernel caching, passed on to FUSE. Defaults to attr_cache_ttl
+    double attr_timeout;     // Defaults to attr_cache_ttl
+    double negative_timeout; // Defaults to attr_cache_negative_ttl
+    unsigned int dir_cache_size;  // MiB of cached directory listings. 0 => no cache
+    double dir_cache_max_age;     // Seconds before a listing is re-read even if its mtime is unchanged
+    char *replica_policy;         // ordered, ewma or p2c
+    int policy;                   // Parsed replica_policy
+    int zero_copy;                // Hand the pinned fd to FUSE so it can splice, see callback_read_buf
+    unsigned int readahead;       // Max chunks prefetched per open file. 0 => no prefetch
+    char *cache_dir;              // Block cache on local disk. NULL => no cache
+    char *cache_size;             // Like 200G
+    unsigned int metadata_timeout; // Milliseconds to wait for one backend call, per op class
+    unsigned int open_timeout;
+    unsigned int read_timeout;
+    unsigned int readdir_timeout;
+    unsigned int request_timeout; // Milliseconds for a whole request, failovers included. 0 => none
+    unsigned int location_cache_size; // Max paths in the location index. 0 => no index
+    double location_cache_ttl;        // Seconds a location index entry is trusted
+    unsigned int threads;      // FUSE request threads. 0 => libfuse starts them as needed
+    unsigned int max_inflight; // Calls queued or running per backend. 0 => no limit
+    int readdir_stat;          // Stat every entry while listing and fill the attr cache
+    char *io_engine;           // threads or uring
+    char *log_sink;            // stdout or journald
+    unsigned int max_stuck;    // Stuck calls on all backends before those with one fail fast
+    int consistency;           // Compare a file's copies on all replicas, see consistent_getattr
+    double consistency_settle; // Seconds without modification before a copy counts as complete
+};
+struct hareadfs_config Conf;
+
+static int Fuse_busy; // FUSE request threads running a callback, with -o threads
+
+// Counters, kept per thread (see thread_stats). Logged on SIGUSR1 and in the stats file
+typedef struct haread_counters
+{
+    unsigned long read_hedges;          // Reads raced against a second replica
+    unsigned long read_hedge_primary;   // Hedged reads won by the pinned replica
+    unsigned long read_hedge_secondary; // Hedged reads won by the other replica
+    unsigned long attr_cache_hits;
+    unsigned long attr_cache_misses;
+    unsigned long dir_cache_hits;   // Replica listings served after an unchanged stat
+    unsigned long dir_cache_misses; // Replica listings read in full
+    unsigned long zero_copy_reads;  // Reads handed to FUSE as an fd
+    unsigned long copied_reads;     // Reads through read_buf that had to be copied
+    unsigned long prefetch_issued;  // Chunks read ahead of a sequential reader
+    unsigned long prefetch_hits;    // Reads served from a prefetched chunk
+    unsigned long prefetch_waste;   // Prefetched chunks dropped unused
+    unsigned long block_cache_hits;      // Reads served from cache_dir
+    unsigned long block_cache_misses;    // Reads on cached files that went to the backends
+    unsigned long block_cache_fills;     // Blocks written to cache_dir
+    unsigned long block_cache_evictions;
+    unsigned long failovers; // Calls retried on another replica after a timeout
+    unsigned long metadata_deadline_misses; // Backend calls that ran out of their op class timeout
+    unsigned long open_deadline_misses;
+    unsigned long read_deadline_misses;
+    unsigned long readdir_deadline_misses;
+    unsigned long request_deadline_misses; // Requests that ran out of request_timeout
+    unsigned long location_hits;   // Requests whose replica order came from the location index
+    unsigned long location_misses;
+    unsigned long location_stale;  // Index entries dropped because a holder said ENOENT
+    unsigned long readdir_attrs;   // Attributes put in the attr cache by a listing, readdir_stat
+    unsigned long uring_calls;     // Backend calls run by io_uring instead of a worker
+    unsigned long uring_cancels;   // io_uring calls cancelled because their caller gave up
+    unsigned long divergent_files; // getattrs that found copies differing in size or still being written
+    unsigned long divergent_reads; // Failover reads refused because the copy differs from the pinned one
+    unsigned long late_calls;      // Calls that returned after their caller gave up
+    unsigned long late_cached;     // Of those, stats and listings put in the caches
+} haread_counters;
+static volatile sig_atomic_t Dump_counters = 0;
+
+#define COUNTER(name) offsetof(haread_counters, name)
 
 
-// Key: file system path. Values:  1 => fs Ok, 0 => fs Blocks, -1 => Key does not exist 
-GHashTable *FSOkMap = NULL;
 
+/******************************
+ *
+ * Logging
+ *
+ * LOG() formats the message on the calling thread into a slot of a lock-free ring (the same
+ * bounded queue as the backend pools use), and one writer thread prints it. A FUSE thread never
+ * waits for stdout, and lines from different threads can not interleave. The writer lets
+ * LOG_BURST messages of each format through per LOG_WINDOW seconds and sums up the rest, so an
+ * outage that makes every request time out logs a line per kind of failure, not one per
+ * request. When the ring is full, messages are dropped and counted. With -o log_sink=journald
+ * lines go to the systemd journal socket, with the monotonic time as a field of its own.
+ *
+ ******************************/
 
+#define LOG_SLOTS 1024 // Must be a power of two
+#define LOG_LINE_MAX 512
+#define LOG_WINDOW 10 // Seconds
+#define LOG_BURST 10  // Messages per format and window before they are summed up
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
 
-static inline void LOG(const char *fmt, ...) 
+typedef struct log_slot
+{
+    size_t seq;
+    const char *fmt; // Identifies the kind of message for rate limiting
+    struct timespec wall;
+    struct timespec mono;
+    char text[LOG_LINE_MAX];
+} log_slot;
+
+typedef struct log_ring
+{
+    log_slot slots[LOG_SLOTS];
+    size_t enqueue_pos __attribute__((aligned(64)));
+    size_t dequeue_pos __attribute__((aligned(64))); // Only the writer moves it
+    sem_t pending __attribute__((aligned(64)));
+    unsigned long dropped; // Ring full
+    int started;           // Until then LOG() writes directly
+    int journal;           // Socket for log_sink=journald, -1 => stdout
+    pthread_t writer;
+} log_ring;
+
+static log_ring Log = {.journal = -1};
+
+// Messages of one format within the current window, writer only
+typedef struct log_limit
+{
+    long long window_start; // Seconds, CLOCK_MONOTONIC
+    unsigned int count;
+    unsigned int suppressed;
+    char last[LOG_LINE_MAX]; // Last suppressed message, shown with the sum
+} log_limit;
+
+static void log_write(const struct timespec *wall, const struct timespec *mono, const char *text)
+{
+    char msg[LOG_LINE_MAX];
+    size_t len = strnlen(text, sizeof(msg) - 1);
+
+    while (len > 0 && text[len - 1] == '\n')
+    {
+        len--;
+    }
+    memcpy(msg, text, len);
+    msg[len] = '\0';
+    if (Log.journal != -1)
+    {
+        char entry[LOG_LINE_MAX + 128];
+        // Native protocol. A newline inside a message would need its binary form
+        for (size_t i = 0; i < len; i++)
+        {
+            if (msg[i] == '\n')
+            {
+                msg[i] = ' ';
+            }
+        }
+        int n = snprintf(entry, sizeof(entry), "PRIORITY=6\nSYSLOG_IDENTIFIER=haread-fs\nHAREAD_MONOTONIC_USEC=%lld\nMESSAGE=%s\n",
+                         mono->tv_sec * 1000000LL + mono->tv_nsec / 1000, msg);
+        if (send(Log.journal, entry, n, 0) != -1)
+        {
+            return;
+        }
+        // Journal gone. Fall through to stdout
+    }
+    struct tm tm;
+    char date[32];
+    gmtime_r(&wall->tv_sec, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(stdout, "%s.%03ld UTC [%lld.%06ld]: %s\n", date, wall->tv_nsec / 1000000, (long long)mono->tv_sec,
+            mono->tv_nsec / 1000, msg);
+}
+
+static void log_now(const char *text)
+{
+    struct timespec wall, mono;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    log_write(&wall, &mono, text);
+}
+
+// Write the sum of what a format had suppressed, and start a new window
+static void log_limit_flush(log_limit *limit, long long now)
+{
+    if (limit->suppressed > 0)
+    {
+        char text[LOG_LINE_MAX + 64];
+        snprintf(text, sizeof(text), "(%u more like this in the last %d s) %s", limit->suppressed, LOG_WINDOW, limit->last);
+        log_now(text);
+    }
+    limit->window_start = now;
+    limit->count = 0;
+    limit->suppressed = 0;
+}
+
+static gboolean log_limit_expire(gpointer key, gpointer value, gpointer now)
+{
+    (void)key;
+    log_limit *limit = value;
+    if (*(long long *)now - limit->window_start < LOG_WINDOW)
+    {
+        return FALSE;
+    }
+    log_limit_flush(limit, *(long long *)now);
+    return TRUE; // Freed, a format that is back gets a new one
+}
+
+void *log_writer(void *arg)
+{
+    (void)arg;
+    GHashTable *limits = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+    unsigned long reported_drops = 0;
+
+    while (1)
+    {
+        struct timespec wait;
+        clock_gettime(CLOCK_REALTIME, &wait);
+        wait.tv_sec += 1;
+        sem_timedwait(&Log.pending, &wait); // Also wakes up every second to sum up
+
+        size_t pos = Log.dequeue_pos;
+        log_slot *slot;
+        while (__atomic_load_n(&(slot = &Log.slots[pos & (LOG_SLOTS - 1)])->seq, __ATOMIC_ACQUIRE) == pos + 1)
+        {
+            log_limit *limit = g_hash_table_lookup(limits, slot->fmt);
+            if (limit == NULL && (limit = calloc(1, sizeof(log_limit))) != NULL)
+            {
+                limit->window_start = slot->mono.tv_sec;
+                g_hash_table_insert(limits, (gpointer)slot->fmt, limit);
+            }
+            if (limit != NULL && slot->mono.tv_sec - limit->window_start >= LOG_WINDOW)
+            {
+                log_limit_flush(limit, slot->mono.tv_sec);
+            }
+            if (limit == NULL || ++limit->count <= LOG_BURST)
+            {
+                log_write(&slot->wall, &slot->mono, slot->text);
+            }
+            else
+            {
+                limit->suppressed++;
+                memcpy(limit->last, slot->text, sizeof(limit->last));
+            }
+            __atomic_store_n(&slot->seq, pos + LOG_SLOTS, __ATOMIC_RELEASE);
+            pos++;
+            __atomic_store_n(&Log.dequeue_pos, pos, __ATOMIC_RELEASE);
+        }
+
+        struct timespec mono;
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        long long now = mono.tv_sec;
+        g_hash_table_foreach_remove(limits, log_limit_expire, &now);
+        unsigned long dropped = __atomic_load_n(&Log.dropped, __ATOMIC_RELAXED);
+        if (dropped != reported_drops)
+        {
+            char text[96];
+            snprintf(text, sizeof(text), "%lu log messages dropped, the log could not keep up", dropped - reported_drops);
+            log_now(text);
+            reported_drops = dropped;
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+static void LOG(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void LOG(const char *fmt, ...)
 {
-    time_t rawtime;
-    struct tm * timeinfo;
-    char buffer[80];
-    
-    time(&rawtime);
-    timeinfo = gmtime(&rawtime);
-    
-    strftime(buffer,80,"%Y-%m-%d %H:%M:%S",timeinfo);
-    printf("%s UTC: ", buffer);
-    
     va_list args;
+
+    if (!__atomic_load_n(&Log.started, __ATOMIC_ACQUIRE))
+    {
+        char text[LOG_LINE_MAX];
+        va_start(args, fmt);
+        vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        log_now(text);
+        return;
+    }
+
+    size_t pos = __atomic_load_n(&Log.enqueue_pos, __ATOMIC_RELAXED);
+    log_slot *slot;
+    for (;;)
+    {
+        slot = &Log.slots[pos & (LOG_SLOTS - 1)];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&Log.enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            __atomic_add_fetch(&Log.dropped, 1, __ATOMIC_RELAXED); // Full
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&Log.enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->fmt = fmt;
+    clock_gettime(CLOCK_REALTIME, &slot->wall);
+    clock_gettime(CLOCK_MONOTONIC, &slot->mono);
     va_start(args, fmt);
-    vprintf(fmt, args);
+    vsnprintf(slot->text, sizeof(slot->text), fmt, args);
     va_end(args);
-    
-    printf("\n");
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&Log.pending);
+}
+
+// Give the writer a moment to print what is queued, for messages logged just before exit()
+static void log_flush(void)
+{
+    for (int i = 0; i < 100 && __atomic_load_n(&Log.dequeue_pos, __ATOMIC_ACQUIRE) != __atomic_load_n(&Log.enqueue_pos, __ATOMIC_RELAXED); i++)
+    {
+        sem_post(&Log.pending);
+        usleep(10000);
+    }
+}
+
+static void start_log(void)
+{
+    if (Conf.log_sink != NULL && strcmp(Conf.log_sink, "journald") == 0)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = JOURNAL_SOCKET};
+        Log.journal = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (Log.journal != -1 && connect(Log.journal, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            close(Log.journal);
+            Log.journal = -1;
+        }
+        if (Log.journal == -1)
+        {
+            log_now("start_log: No journald at " JOURNAL_SOCKET ". Logging to stdout\n");
+        }
+    }
+    for (size_t s = 0; s < LOG_SLOTS; s++)
+    {
+        Log.slots[s].seq = s;
+    }
+    sem_init(&Log.pending, 0, 0);
+    if (pthread_create(&Log.writer, NULL, log_writer, NULL) != 0)
+    {
+        perror("pthread_create");
+        return; // Keep writing directly
+    }
+    atexit(log_flush);
+    __atomic_store_n(&Log.started, 1, __ATOMIC_RELEASE);
 }
 
 
@@ -118,535 +466,5006 @@ char **split_string(char *str, const char *delimiter)
     return result;
 }
 
-// Translate an fs path into it's underlying filesystem path
-// Fix todo no need to use a global var
-static char *translate_path(const char *path)
-{
-
-    char *rPath = malloc(sizeof(char) * (strlen(path) + strlen(Currfs) + 1));
+// Length of each Fss entry without trailing slashes, set once at startup
+size_t *Fslen;
 
-    strcpy(rPath, Currfs);
-    if (rPath[strlen(rPath) - 1] == '/')
+static void normalize_fss(void)
+{
+    Fslen = malloc(Fscount * sizeof(size_t));
+    for (int i = 0; i < Fscount; i++)
     {
-        rPath[strlen(rPath) - 1] = '\0';
+        Fslen[i] = strlen(Fss[i]);
+        while (Fslen[i] > 0 && Fss[i][Fslen[i] - 1] == '/')
+        {
+            Fslen[i]--;
+        }
     }
-    strcat(rPath, path);
-
-    return rPath;
 }
 
-
-int retrieve_from_hash_table(GHashTable *hash_table, char *key)
+// Split the optional ":priority[:weight]" off each of Fss, like /a:1,/b:1,/c:2. Returns -1, or
+// the index of an entry with an empty path or a weight of 0
+static int parse_fss_specs(void)
 {
-    if (g_hash_table_contains(hash_table, key))
+    Fsprio = malloc(Fscount * sizeof(int));
+    Fsweight = malloc(Fscount * sizeof(unsigned int));
+    for (int i = 0; i < Fscount; i++)
     {
-        return GPOINTER_TO_INT(g_hash_table_lookup(hash_table, key));
+        unsigned long nums[2];
+        int n = 0;
+        char *colon;
+
+        // From the right, so nums is {weight, prio} or {prio}
+        while (n < 2 && (colon = strrchr(Fss[i], ':')) != NULL && colon[1] != '\0' &&
+               strspn(colon + 1, "0123456789") == strlen(colon + 1))
+        {
+            nums[n++] = strtoul(colon + 1, NULL, 10);
+            *colon = '\0';
+        }
+        Fsprio[i] = n == 0 ? 1 : nums[n - 1];
+        Fsweight[i] = n == 2 ? nums[0] : 1;
+        if (Fsweight[i] == 0 || Fss[i][0] == '\0')
+        {
+            return i;
+        }
     }
-    else
+    return -1;
+}
+
+// Translate an fs path into its path on underlying filesystem fsno. rpath holds PATH_MAX bytes.
+// Returns 0, or ENAMETOOLONG
+static int translate_path(int fsno, const char *path, char *rpath)
+{
+    size_t len = strlen(path);
+
+    if (Fslen[fsno] + len >= PATH_MAX)
     {
-        return -1; // key doesn't exist, 
+        return ENAMETOOLONG;
     }
+    memcpy(rpath, Fss[fsno], Fslen[fsno]);
+    memcpy(rpath + Fslen[fsno], path, len + 1);
+    return 0;
 }
 
 
 /******************************
  *
- * Callbacks for FUSE
+ * Backend health
+ *
+ * One cache line per underlying filesystem, indexed like Fss. Written by the monitor threads and
+ * the workers, read with relaxed atomic loads by every callback, no locking.
+ *
+ * The state is a circuit breaker fed by the monitor probes and by real calls. Closed (FS_OK):
+ * calls go through. A probe or call that fails or times out opens it (FS_BLOCKS): calls skip the
+ * backend until retry_at. Then one caller, a real call or the next probe, gets through as the
+ * trial (FS_HALF_OPEN). If it answers the breaker closes, otherwise it opens again for twice as
+ * long. A hung server thus costs one slow call, not a timeout on every call.
  *
  ******************************/
 
-typedef struct
-{
-    const char *path;
-    struct stat *stbuf;
-} getattr_args;
+#define FS_UNKNOWN -1 // Not probed yet
+#define FS_BLOCKS 0   // Breaker open
+#define FS_OK 1       // Breaker closed
+#define FS_HALF_OPEN 2 // One trial call in flight
 
-// The struct to pass arguments to the thread
-typedef struct arg_struct_lstat
-{
-    char *path;
-    struct stat *st_data;
-    int res;
-    int errnum;
-} arg_struct_lstat;
+#define EWMA_WEIGHT 8 // New sample counts 1/EWMA_WEIGHT
+#define BREAKER_BACKOFF_MIN_MS 1000
+#define BREAKER_BACKOFF_MAX_MS 60000
+#define BREAKER_TRIAL_MS 5000 // Let another trial through if the last one has not answered by then
 
-// The lstat function to run in a separate thread
-void *thread_lstat(void *arguments)
+typedef struct backend_health
 {
-    arg_struct_lstat *args = (arg_struct_lstat *)arguments;
-    args->res = lstat(args->path, args->st_data);
-    if (args->res == -1)
-    {
-        args->errnum = errno;
-    }
-    return NULL;
+    int state;                 // FS_OK, FS_BLOCKS, FS_HALF_OPEN or FS_UNKNOWN
+    int consecutive_failures;  // Probes and calls failed or timed out since the last success
+    long long last_success;    // monotonic_ms() of the last successful probe or call
+    unsigned int latency_ewma; // Microseconds, 0 until the first sample
+    int backoff_ms;            // How long the breaker stays open after the next failed trial
+    long long retry_at;        // monotonic_ms() when the next trial may go through
+    unsigned long trips;       // Times the breaker opened
+    unsigned long trials;      // Trial calls and probes let through while open
+} __attribute__((aligned(64))) backend_health;
+
+backend_health *Health;
+static pthread_mutex_t HealthLock = PTHREAD_MUTEX_INITIALIZER; // Breaker transitions, rare
+
+static long long monotonic_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 }
 
-#define MAX_THREADS 5
-#define MAX_FS 5
+static inline int fs_state(int fsno)
+{
+    return __atomic_load_n(&Health[fsno].state, __ATOMIC_RELAXED);
+}
 
-static int callback_getattr(const char *path, struct stat *st_data)
+// Breaker open, or only letting a trial through
+static inline int fs_blocks(int fsno)
 {
-    //DEBUG("CALLLBACK_GETATRR %s\n", "sd");
+    int state = fs_state(fsno);
+    return state == FS_BLOCKS || state == FS_HALF_OPEN;
+}
 
-    char *ipath = NULL;
-    arg_struct_lstat args;
+static void health_record_latency(int fsno, long us)
+{
+    backend_health *health = &Health[fsno];
+    unsigned int old = __atomic_load_n(&health->latency_ewma, __ATOMIC_RELAXED);
+    unsigned int new;
 
-    int all_timed_out = 1;
-    int timed_out_last_iteration[MAX_FS] = {0};
-    for (int i = 0; i < Fscount; i++)
+    do
     {
-        Currfs = Fss[i];
-        int fs_status = retrieve_from_hash_table(FSOkMap, Currfs);
-        if (fs_status == 0) // File system blocks. Continue
-        {
-            continue;
-        }
-        ipath = translate_path(path);
+        new = old == 0 ? us : old + ((long)us - (long)old) / EWMA_WEIGHT;
+    } while (!__atomic_compare_exchange_n(&health->latency_ewma, &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-        pthread_t thread_id;
+// Whether a call may be sent to backend fsno now. While the breaker is open the first caller
+// after retry_at becomes the trial, everyone else is turned away until it has an answer
+static int health_admit(int fsno)
+{
+    backend_health *health = &Health[fsno];
+    int state = fs_state(fsno);
 
-        args.path = ipath;
-        args.st_data = st_data;
+    if (state == FS_OK || state == FS_UNKNOWN)
+    {
+        return 1;
+    }
+    long long now = monotonic_ms();
+    if (now < __atomic_load_n(&health->retry_at, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    int admitted = 0;
+    pthread_mutex_lock(&HealthLock);
+    state = health->state;
+    if ((state == FS_BLOCKS || state == FS_HALF_OPEN) && now >= health->retry_at)
+    {
+        __atomic_store_n(&health->retry_at, now + BREAKER_TRIAL_MS, __ATOMIC_RELAXED);
+        __atomic_store_n(&health->state, FS_HALF_OPEN, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&health->trials, 1, __ATOMIC_RELAXED);
+        admitted = 1;
+    }
+    else
+    {
+        admitted = state == FS_OK || state == FS_UNKNOWN;
+    }
+    pthread_mutex_unlock(&HealthLock);
+    return admitted;
+}
 
-        // Create a new thread to call lstat
-        pthread_create(&thread_id, NULL, thread_lstat, &args);
+// The backend answered a probe or a call. Closes the breaker
+static void health_success(int fsno)
+{
+    backend_health *health = &Health[fsno];
 
-        // Set the timeout to 1 second
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
+    __atomic_store_n(&health->last_success, monotonic_ms(), __ATOMIC_RELAXED);
+    if (fs_state(fsno) == FS_OK && __atomic_load_n(&health->consecutive_failures, __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&HealthLock);
+    if (health->state == FS_BLOCKS || health->state == FS_HALF_OPEN)
+    {
+        LOG("%s is back online\n", Fss[fsno]);
+    }
+    __atomic_store_n(&health->consecutive_failures, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&health->state, FS_OK, __ATOMIC_RELAXED);
+    health->backoff_ms = BREAKER_BACKOFF_MIN_MS;
+    pthread_mutex_unlock(&HealthLock);
+}
 
-        timeout.tv_sec += 5;
+// A probe or call failed or timed out. Opens the breaker, for twice as long as last time when
+// it was the trial that failed
+static void health_failure(int fsno)
+{
+    backend_health *health = &Health[fsno];
 
-        // Wait for the thread to complete with a timeout
-        if (pthread_timedjoin_np(thread_id, NULL, &timeout) != 0)
+    __atomic_add_fetch(&health->consecutive_failures, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&HealthLock);
+    if (health->state != FS_BLOCKS)
+    {
+        if (health->state != FS_HALF_OPEN || health->backoff_ms == 0)
         {
-            // The call to lstat timed out
-            LOG("callback_getattr: Timeout on  %s\n", Currfs);
-            timed_out_last_iteration[i]++;
-            continue;
-        } 
-        if (timed_out_last_iteration[i]) {
-            LOG("callback_getattr: %s back online after timed out %d times\n",  Currfs,  timed_out_last_iteration[i]);
-            timed_out_last_iteration[i] = 0;
+            health->backoff_ms = BREAKER_BACKOFF_MIN_MS;
         }
-        
-        all_timed_out = 0;
-        free(ipath);
-        if (args.res == 0)
+        else if (health->backoff_ms < BREAKER_BACKOFF_MAX_MS)
         {
-            return 0;
+            health->backoff_ms = health->backoff_ms * 2 < BREAKER_BACKOFF_MAX_MS ? health->backoff_ms * 2 : BREAKER_BACKOFF_MAX_MS;
         }
+        if (health->state != FS_HALF_OPEN)
+        {
+            LOG("%s is not answering. Next try in %d ms\n", Fss[fsno], health->backoff_ms);
+        }
+        __atomic_store_n(&health->retry_at, monotonic_ms() + health->backoff_ms, __ATOMIC_RELAXED);
+        __atomic_store_n(&health->state, FS_BLOCKS, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&health->trips, 1, __ATOMIC_RELAXED);
     }
-
-    if  (all_timed_out ) {
-        return - ETIMEDOUT;
-    }
-    if (args.res == -1)
-    {
-        return -args.errnum;
-    }
-    return 0;
+    pthread_mutex_unlock(&HealthLock);
 }
 
-static int callback_readlink(const char *path, char *buf, size_t size)
+// Monitor probe answered
+static void health_probe_ok(int fsno, long us)
 {
-    DEBUG("CALLLBACK_READLINK %s\n", path);
-
-    int res;
-    char *ipath;
-    ipath = translate_path(path);
-
-    res = readlink(ipath, buf, size - 1);
-    free(ipath);
-    if (res == -1)
-    {
-        return -errno;
-    }
-    buf[res] = '\0';
-    return 0;
+    health_record_latency(fsno, us);
+    health_success(fsno);
 }
 
-// The struct to pass directory path to the thread
-typedef struct arg_struct_opendir
+// Monitor probe failed or timed out
+static void health_probe_failed(int fsno)
 {
-    char *path;
-    DIR *dp;
-    int res;
-} arg_struct_opendir;
+    health_failure(fsno);
+}
 
-// The opendir function to run in a separate thread
-void *thread_opendir(void *arguments)
+static void start_health(void)
 {
-    arg_struct_opendir *args = (arg_struct_opendir *)arguments;
-    args->dp = opendir(args->path);
-    if (args->dp == NULL)
+    if (posix_memalign((void **)&Health, 64, Fscount * sizeof(backend_health)) != 0)
     {
-        args->res = errno;
+        perror("posix_memalign");
+        exit(1);
     }
-    else
+    memset(Health, 0, Fscount * sizeof(backend_health));
+    for (int i = 0; i < Fscount; i++)
     {
-        args->res = 0;
+        Health[i].state = FS_UNKNOWN;
+        Health[i].backoff_ms = BREAKER_BACKOFF_MIN_MS;
     }
-    return NULL;
 }
 
-// Function to insert key-value pair into hash table
-void insert_to_hash_table(GHashTable *hash_table, char *key, int value)
+
+
+/******************************
+ *
+ * Backend worker pools
+ *
+ * Blocking calls against an underlying file system (lstat, open, pread, opendir, close) run on a
+ * fixed set of worker threads per backend, so a hung NFS/CIFS server can not make us create new
+ * threads without bound. Callers submit a job through a lock-free queue and wait for it with a
+ * deadline. A job the caller gave up on is abandoned: the worker skips it if it has not started
+ * yet, otherwise it counts as stuck until the call returns and the worker releases its resources.
+ * Stuck calls are listed per backend, and their answers still go to the caches when they come.
+ *
+ ******************************/
+
+#define WORKERS_PER_FS 8
+#define JOB_QUEUE_SIZE 1024 // Must be a power of two
+#define MAX_STUCK_PER_FS 4  // Fail fast when this many calls are stuck on a backend
+#define MAX_STUCK_DEFAULT 16 // Or when this many are stuck on all of them, see max_stuck
+#define TIMEOUT_DEFAULT_MS 5000 // Per backend call. Taken out of thin air
+#define TIMEOUT_MAX_MS 3600000  // Longer is a typo. A hung call would hold its worker that long
+#define LATENCY_SAMPLES 256 // Recent read latencies kept per backend for the hedge threshold
+#define HEDGE_DEFAULT_MS 100 // Hedge threshold until enough samples are collected
+#define HEDGE_MIN_US 1000   // Never hedge faster than this, page cache hits would always race
+
+typedef enum
 {
-    g_hash_table_insert(hash_table, g_strdup(key), GINT_TO_POINTER(value));
-}
+    JOB_LSTAT,
+    JOB_OPEN,
+    JOB_READ,
+    JOB_READDIR,
+    JOB_CLOSE,
+    JOB_FADVISE,
+    JOB_CACHE_FILL,
+    JOB_STATAT, // Helps the JOB_READDIR that submitted it stat its entries, see stat_entries()
+    JOB_READLINK,
+    JOB_STATFS,
+    JOB_ACCESS,
+    JOB_GETXATTR,
+    JOB_LISTXATTR,
+} job_type;
+
+#define JOB_TYPES (JOB_LISTXATTR + 1)
+#define STAT_BATCH 64 // Entries per fstatat() batch, and per helper job of a listing
+
+// Lets a caller wait for the first of several jobs to complete
+typedef struct job_group
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} job_group;
+
+// An fd on a backend, shared by an open file and the jobs reading from it. Closed on the backend
+// when the last reference is dropped, so a read still queued or running on it never gets a
+// reused fd number
+typedef struct backend_fd
+{
+    int fsno;
+    int fd;
+    int refs;
+} backend_fd;
 
-int filldir(const char *path, void *buf, fuse_fill_dir_t filler, GHashTable *filesMap)
+typedef struct backend_job
 {
-    // DIR *dp;
-    struct dirent *de;
-    pthread_t thread_id;
-    arg_struct_opendir args;
-    char *ipath;
+    job_type type;
+    int fsno;
+    char *path; // Translated path on the backend, in pathbuf. NULL for jobs on an fd
+    int flags;     // JOB_OPEN and JOB_READ: open flags. JOB_ACCESS: the mode
+    int fd;        // JOB_READ: fd to read from, or -1 to open path first. JOB_OPEN: the result
+    int owns_fd;   // Close fd when the job is freed. Clear it to take over the fd
+    backend_fd *shared; // The fd is this one. Holds a reference until the job is freed
+    char *buf;     // Owned. JOB_READ destination, so a late completion never writes to the caller.
+                   // Same for the result of JOB_READLINK, JOB_STATFS and the xattr jobs
+    char *name;    // Owned. JOB_GETXATTR: the attribute
+    size_t size;
+    off_t offset;
+    struct stat st;
+    GPtrArray *entries; // JOB_READDIR result, dir_entry items
+    struct cache_block *cache_block; // JOB_CACHE_FILL: the block to fill
+    struct stat_batch *batch;        // JOB_STATAT: the listing to help with
+    ssize_t res;
+    int errnum;
 
-    ipath = translate_path(path);
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    job_group *group; // Also signalled on completion. Cleared under lock when the job is released
+    struct timespec submitted;
+    struct timespec deadline; // The caller's, if job_run() knows it. 0 => the op class timeout
+    int refs;      // Caller + worker
+    int started;
+    int done;
+    int abandoned;
+    int discarded; // Abandoned on purpose (lost a hedge race). Not counted as stuck
+    int queued;    // Accepted by job_submit(). A job that never was is not a backend failure
+    int unlimited; // Not turned away by max_inflight, the caller can not use another replica
+    int prefetch;  // JOB_READ for readahead, nobody waits for it yet
+    GList stuck_link; // In its pool's stuck_jobs while abandoned and still running
+#ifdef HAVE_IO_URING
+    int uring;     // Submitted to the io_uring engine instead of a worker
+    struct statx stx;
+    struct __kernel_timespec uring_timeout;
+#endif
+    char pathbuf[];
+} backend_job;
+
+// One directory entry as read from a backend
+typedef struct dir_entry
+{
+    ino_t ino;
+    unsigned char type; // d_type
+    struct stat *st;    // readdir_stat: owned, NULL if the fstatat() failed
+    char name[];
+} dir_entry;
+
+// fstatat() of the entries of a listing, shared by the worker that read it and helper jobs on
+// the other workers of the backend. Each takes STAT_BATCH entries at a time until none are left
+typedef struct stat_batch
+{
+    int dirfd;
+    GPtrArray *entries; // Only touched while next < count, the reader waits for that
+    guint count;
+    guint next;  // First entry nobody took yet
+    int active;  // Helpers working on entries. The reader keeps dirfd open until there are none
+    int refs;    // Reader + helper jobs, a helper may only run after the reader is done
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} stat_batch;
+
+typedef struct job_slot
+{
+    size_t seq;
+    backend_job *job;
+} job_slot;
+
+// Bounded multi-producer multi-consumer queue (Dmitry Vyukov's design)
+typedef struct backend_pool
+{
+    job_slot slots[JOB_QUEUE_SIZE];
+    size_t enqueue_pos __attribute__((aligned(64)));
+    size_t dequeue_pos __attribute__((aligned(64)));
+    sem_t pending __attribute__((aligned(64)));
+    int stuck;    // Abandoned calls still running on a worker
+    GQueue stuck_jobs; // Those calls, oldest first. Under stuck_lock
+    pthread_mutex_t stuck_lock;
+    int inflight; // Submitted calls not completed or skipped yet
+    unsigned long busy; // Calls turned away because inflight was at max_inflight or the queue was full
+    pthread_t workers[WORKERS_PER_FS];
+
+    // Latencies of reads a caller waited for, in microseconds. Atomic, written by the workers
+    unsigned int read_latency[LATENCY_SAMPLES];
+    unsigned long read_samples;
+    unsigned int hedge_threshold; // Microseconds, p95 of read_latency. 0 until enough samples
+} backend_pool;
+
+backend_pool *Pools; // One per underlying filesystem
+static int Stuck_total; // Stuck calls on all backends
+
+static pthread_condattr_t Job_condattr;
 
-    args.path = ipath;
+/******************************
+ *
+ * Latency statistics
+ *
+ * Per thread, so recording is a few plain stores to memory only this thread writes. Readers
+ * (the stats file) sum all threads with relaxed loads. Histograms are log bucketed, 4 buckets
+ * per power of two microseconds, like HDR histograms with 2 bits of precision.
+ *
+ ******************************/
 
-    // Create a new thread to open the directory
-    pthread_create(&thread_id, NULL, thread_opendir, &args);
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_MSB 35 // Everything from 2^35 us (about 9.5 hours) up lands in the last bucket
+#define HIST_BUCKETS (HIST_SUB + (HIST_MAX_MSB - HIST_SUB_BITS + 1) * HIST_SUB)
 
-    // Set the timeout to 1 second
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += 5;
+typedef enum
+{
+    OP_GETATTR,
+    OP_READLINK,
+    OP_READDIR,
+    OP_OPEN,
+    OP_READ,
+    OP_READ_BUF,
+    OP_RELEASE,
+    OP_STATFS,
+    OP_ACCESS,
+    OP_GETXATTR,
+    OP_LISTXATTR,
+    OPS // Number of ops, not an op
+} stats_op;
+
+static const char *Op_names[OPS] = {"getattr", "readlink", "readdir", "open", "read", "read_buf",
+                                    "release", "statfs", "access", "getxattr", "listxattr"};
+static const char *Job_names[JOB_TYPES] = {"lstat", "open", "read", "readdir", "close", "fadvise", "cache_fill",
+                                          "statat", "readlink", "statfs", "access", "getxattr", "listxattr"};
+
+typedef struct latency_histogram
+{
+    unsigned long count;
+    unsigned long errors;
+    unsigned long long sum_us;
+    unsigned long buckets[HIST_BUCKETS];
+} latency_histogram;
 
-    // Wait for the thread to complete with a timeout
-    if (pthread_timedjoin_np(thread_id, NULL, &timeout) != 0)
+typedef struct thread_stats
+{
+    struct thread_stats *next;
+    int in_use; // Cleared when the thread exits, the next new thread takes it over
+    haread_counters counters;
+    latency_histogram ops[OPS];
+    latency_histogram backend[]; // [fsno * JOB_TYPES + job type]
+} thread_stats;
+
+static thread_stats *Stats = NULL; // All blocks, never freed
+static pthread_mutex_t StatsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t StatsKey;
+static __thread thread_stats *My_stats = NULL;
+
+static int hist_bucket(unsigned long long us)
+{
+    if (us < HIST_SUB)
     {
-        // The call to opendir timed out
-        LOG("Call to opendir(%s) timed out\n", ipath);
-        free(ipath);
-        return ETIMEDOUT;
+        return us;
     }
-    
-    free(ipath);
-
-    if (args.dp == NULL)
+    int msb = 63 - __builtin_clzll(us);
+    if (msb > HIST_MAX_MSB)
     {
-        return args.res;
+        return HIST_BUCKETS - 1;
     }
+    return HIST_SUB + (msb - HIST_SUB_BITS) * HIST_SUB + ((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
 
-    // TODO Test for time out also here 
-    while ((de = readdir(args.dp)) != NULL)
+// Exclusive upper bound of a bucket, in microseconds
+static unsigned long long hist_bucket_upper(int bucket)
+{
+    if (bucket < HIST_SUB)
     {
-        struct stat st;
-        memset(&st, 0, sizeof(st));
-        st.st_ino = de->d_ino;
-        st.st_mode = de->d_type << 12;
-        if (g_hash_table_contains(filesMap, de->d_name))
-        {
-            continue;
-        }
-        if (filler(buf, de->d_name, &st, 0))
-            break;
-        insert_to_hash_table(filesMap, de->d_name, 1);
-        
+        return bucket + 1;
     }
-
-    closedir(args.dp);
-    
-    return 0;
+    int msb = (bucket - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+    int sub = (bucket - HIST_SUB) % HIST_SUB;
+    return (unsigned long long)(HIST_SUB + sub + 1) << (msb - HIST_SUB_BITS);
 }
 
+static void stats_thread_exit(void *data)
+{
+    thread_stats *stats = data;
+    __atomic_store_n(&stats->in_use, 0, __ATOMIC_RELEASE);
+}
 
-
-static int callback_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+static thread_stats *my_stats(void)
 {
-
-    (void)offset;
-    (void)fi;
-
-    GHashTable *filesMap = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-
-    Currfs = Fss[0];
-    int fs_status = retrieve_from_hash_table(FSOkMap,  Currfs);
-
-    
-    // TODO For loop ..
-    int ret1 = 0;
-    if (fs_status == 1)
-    { // Fs Ok
-        ret1 = filldir(path, buf, filler, filesMap);
-        if (ret1 != 0 && (ret1 != ENOENT && ret1 != ETIMEDOUT))
+    if (My_stats != NULL)
+    {
+        return My_stats;
+    }
+    pthread_mutex_lock(&StatsLock);
+    for (thread_stats *stats = Stats; stats != NULL; stats = stats->next)
+    {
+        if (!__atomic_load_n(&stats->in_use, __ATOMIC_ACQUIRE))
         {
-            return -ret1;
+            My_stats = stats;
+            break;
         }
     }
-
-    // Next fs
-    Currfs = Fss[1];
-    fs_status = retrieve_from_hash_table(FSOkMap, Currfs);
-    int ret2 = 0;
-    if (fs_status == 1) // Fs available
+    if (My_stats == NULL)
     {
-        ret2 = filldir(path, buf, filler, filesMap);
+        My_stats = calloc(1, sizeof(thread_stats) + Fscount * JOB_TYPES * sizeof(latency_histogram));
+        if (My_stats == NULL)
+        {
+            pthread_mutex_unlock(&StatsLock);
+            return NULL;
+        }
+        My_stats->next = Stats;
+        __atomic_store_n(&Stats, My_stats, __ATOMIC_RELEASE);
     }
-   
-    g_hash_table_destroy(filesMap);
+    My_stats->in_use = 1;
+    pthread_mutex_unlock(&StatsLock);
+    pthread_setspecific(StatsKey, My_stats);
+    return My_stats;
+}
+
+// Single writer, so no atomic read-modify-write. The stores are atomic for the readers
+static inline void hist_add(unsigned long *counter, unsigned long n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
 
-    if (ret1 == 0 || ret2 == 0)
+static inline void count(size_t counter)
+{
+    thread_stats *stats = my_stats();
+    if (stats != NULL)
     {
-        return 0;
+        hist_add((unsigned long *)((char *)&stats->counters + counter), 1);
     }
+}
 
-    if (ret2 != 0)
+static unsigned long counter_total(size_t counter)
+{
+    unsigned long total = 0;
+    for (thread_stats *stats = __atomic_load_n(&Stats, __ATOMIC_ACQUIRE); stats != NULL; stats = stats->next)
     {
-        return -ret2;
+        total += __atomic_load_n((unsigned long *)((char *)&stats->counters + counter), __ATOMIC_RELAXED);
     }
-
-    return 0;
+    return total;
 }
 
-static int callback_mknod(const char *path, mode_t mode, dev_t rdev)
+static void hist_record(latency_histogram *hist, long us, int error)
 {
-    (void)path;
-    (void)mode;
-    (void)rdev;
-    return -EROFS;
+    if (us < 0)
+    {
+        us = 0;
+    }
+    hist_add(&hist->count, 1);
+    hist_add(&hist->errors, error != 0);
+    __atomic_store_n(&hist->sum_us, hist->sum_us + us, __ATOMIC_RELAXED);
+    hist_add(&hist->buckets[hist_bucket(us)], 1);
 }
 
-static int callback_mkdir(const char *path, mode_t mode)
+static long long stats_start(void)
 {
-    (void)path;
-    (void)mode;
-    return -EROFS;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
 }
 
-static int callback_unlink(const char *path)
+// A FUSE callback returning res, started at stats_start() time start
+static void stats_op_done(stats_op op, long long start, int res)
 {
-    (void)path;
-    return -EROFS;
+    thread_stats *stats = my_stats();
+    if (stats != NULL)
+    {
+        hist_record(&stats->ops[op], stats_start() - start, res < 0 && res != -ENOENT);
+    }
 }
 
-static int callback_rmdir(const char *path)
+static void stats_backend_done(int fsno, job_type type, long us, int error)
 {
-    (void)path;
-    return -EROFS;
+    thread_stats *stats = my_stats();
+    if (stats != NULL)
+    {
+        hist_record(&stats->backend[fsno * JOB_TYPES + type], us, error);
+    }
 }
 
-static int callback_symlink(const char *from, const char *to)
+static void start_stats(void)
 {
-    (void)from;
-    (void)to;
-    return -EROFS;
+    pthread_key_create(&StatsKey, stats_thread_exit);
 }
 
-static int callback_rename(const char *from, const char *to)
+static int job_enqueue(backend_pool *pool, backend_job *job)
 {
-    (void)from;
-    (void)to;
-    return -EROFS;
+    size_t pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+    job_slot *slot;
+
+    for (;;)
+    {
+        slot = &pool->slots[pos & (JOB_QUEUE_SIZE - 1)];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&pool->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return EAGAIN; // Full
+        }
+        else
+        {
+            pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->job = job;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
 }
 
-static int callback_link(const char *from, const char *to)
+static backend_job *job_dequeue(backend_pool *pool)
 {
-    (void)from;
-    (void)to;
-    return -EROFS;
+    size_t pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+    job_slot *slot;
+
+    for (;;)
+    {
+        slot = &pool->slots[pos & (JOB_QUEUE_SIZE - 1)];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&pool->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return NULL; // Empty, or the producer has not published the slot yet
+        }
+        else
+        {
+            pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    backend_job *job = slot->job;
+    __atomic_store_n(&slot->seq, pos + JOB_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return job;
 }
 
-static int callback_chmod(const char *path, mode_t mode)
+// Create a job for backend fsno on path (as FUSE sees it, or NULL), translated in the same
+// allocation. Returns NULL with errno set on failure
+static backend_job *job_new(job_type type, int fsno, const char *path)
 {
-    (void)path;
-    (void)mode;
-    return -EROFS;
+    size_t pathsize = path == NULL ? 0 : Fslen[fsno] + strlen(path) + 1;
+    if (pathsize > PATH_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    backend_job *job = calloc(1, sizeof(backend_job) + pathsize);
+    if (job == NULL)
+    {
+        return NULL;
+    }
+    if (path != NULL)
+    {
+        translate_path(fsno, path, job->pathbuf);
+        job->path = job->pathbuf;
+    }
+    job->type = type;
+    job->fsno = fsno;
+    job->fd = -1;
+    job->res = -1;
+    job->refs = 2;
+    // Listings merge every replica and an fd must be closed where it was opened
+    job->unlimited = type == JOB_READDIR || type == JOB_CLOSE;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, &Job_condattr);
+    return job;
 }
 
-static int callback_chown(const char *path, uid_t uid, gid_t gid)
+static void stat_batch_unref(stat_batch *batch)
 {
-    (void)path;
-    (void)uid;
-    (void)gid;
-    return -EROFS;
+    if (__atomic_sub_fetch(&batch->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+    pthread_cond_destroy(&batch->cond);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch);
 }
 
-static int callback_truncate(const char *path, off_t size)
+static void backend_fd_put(backend_fd *bfd);
+
+static void job_unref(backend_job *job)
 {
-    (void)path;
-    (void)size;
-    return -EROFS;
+    if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+    if (job->batch != NULL)
+    {
+        stat_batch_unref(job->batch);
+    }
+    if (job->owns_fd && job->fd != -1)
+    {
+        close(job->fd);
+    }
+    if (job->shared != NULL)
+    {
+        backend_fd_put(job->shared);
+    }
+    if (job->entries != NULL)
+    {
+        g_ptr_array_unref(job->entries); // May still be referenced by the directory cache
+    }
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job->buf);
+    free(job->name);
+    free(job);
 }
 
-static int callback_utime(const char *path, struct utimbuf *buf)
+static long elapsed_us(const struct timespec *since)
 {
-    (void)path;
-    (void)buf;
-    return -EROFS;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_nsec - since->tv_nsec) / 1000;
 }
 
-typedef struct arg_struct_open
+static int compare_uint(const void *a, const void *b)
 {
-    char *path;
-    int flags;
-    int res;
-    int errnum;
-
-} arg_struct_open;
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
 
-void *thread_open(void *arguments)
+// Record how long a read took, from submit to completion, and refresh the p95 now and then.
+// Workers record and copy the samples concurrently, so each one is an atomic store and load
+static void record_read_latency(backend_pool *pool, long us)
 {
-    arg_struct_open *args = (arg_struct_open *)arguments;
-    args->res = open(args->path, args->flags);
-    if (args->res == -1)
+    unsigned int sorted[LATENCY_SAMPLES];
+    unsigned long n = __atomic_fetch_add(&pool->read_samples, 1, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&pool->read_latency[n % LATENCY_SAMPLES], us > 0 ? us : 0, __ATOMIC_RELAXED);
+    if (n < 32 || n % 32 != 0)
     {
-        args->errnum = errno;
+        return;
     }
-    return NULL;
+    n = n < LATENCY_SAMPLES ? n : LATENCY_SAMPLES;
+    for (unsigned long i = 0; i < n; i++)
+    {
+        sorted[i] = __atomic_load_n(&pool->read_latency[i], __ATOMIC_RELAXED);
+    }
+    qsort(sorted, n, sizeof(unsigned int), compare_uint);
+    __atomic_store_n(&pool->hedge_threshold, sorted[n * 95 / 100], __ATOMIC_RELAXED);
 }
 
-static int callback_open(const char *path, struct fuse_file_info *finfo)
-{
+static int job_submit(backend_job *job);
 
-    int flags = finfo->flags;
+static void dir_entry_free(void *data)
+{
+    dir_entry *entry = data;
+    free(entry->st);
+    free(entry);
+}
 
-    if ((flags & O_WRONLY) || (flags & O_RDWR) || (flags & O_CREAT) || (flags & O_EXCL) || (flags & O_TRUNC) || (flags & O_APPEND))
+// Stat entries of the batch until all are taken. The reader (helper 0) then waits for the
+// helpers that are still at it
+static void stat_batch_work(stat_batch *batch, int helper)
+{
+    pthread_mutex_lock(&batch->lock);
+    if (helper)
     {
-        return -EROFS;
+        if (batch->next >= batch->count) // Done before we got to run
+        {
+            pthread_mutex_unlock(&batch->lock);
+            return;
+        }
+        batch->active++;
     }
-    
-    // Disabled due to to much spam ..
-    //DEBUG("CALLLBACK_OPEN %s\n", path);
-
-    arg_struct_open args;
-    int all_timed_out = 1;
-    for (int i = 0; i < Fscount; i++) // Try open .
+    while (batch->next < batch->count)
     {
-        Currfs = Fss[i];
-        char *ipath = translate_path(path);
-        pthread_t thread_id;
-        args.path = ipath;
-        args.flags = flags;
-        pthread_create(&thread_id, NULL, thread_open, &args);
-
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += 5;
-
-        if (pthread_timedjoin_np(thread_id, NULL, &timeout) != 0)
+        guint first = batch->next;
+        guint last = batch->count - first > STAT_BATCH ? first + STAT_BATCH : batch->count;
+        batch->next = last;
+        pthread_mutex_unlock(&batch->lock);
+        for (guint i = first; i < last; i++)
         {
-            LOG("callback_read: open(%s) timed out. Trying next fs if any\n", ipath);
-            free(ipath);
-            continue;
+            dir_entry *entry = g_ptr_array_index(batch->entries, i);
+            struct stat *st = malloc(sizeof(struct stat));
+            if (st != NULL && fstatat(batch->dirfd, entry->name, st, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+                entry->st = st;
+            }
+            else
+            {
+                free(st); // getattr will ask again
+            }
         }
-        all_timed_out = 0;
-        free(ipath);
+        pthread_mutex_lock(&batch->lock);
+    }
+    if (helper)
+    {
+        if (--batch->active == 0)
+        {
+            pthread_cond_broadcast(&batch->cond);
+        }
+    }
+    else
+    {
+        while (batch->active > 0)
+        {
+            pthread_cond_wait(&batch->cond, &batch->lock);
+        }
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
 
-        if (args.res != -1  ) {
-            close(args.res);
-            //finfo->fh = args.res;
+// Stat all entries of a listing relative to its open directory, like readdirplus. Big listings
+// are shared with helper jobs on the backend's other workers. The reader does not wait for a
+// helper that has not started yet, so this can not deadlock when all workers are busy
+static void stat_entries(backend_job *job, int dirfd)
+{
+    stat_batch *batch = calloc(1, sizeof(stat_batch));
+    if (batch == NULL)
+    {
+        return; // Listed without attributes
+    }
+    batch->dirfd = dirfd;
+    batch->entries = job->entries;
+    batch->count = job->entries->len;
+    batch->refs = 1;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+
+    // One batch per worker at least, the reader being one of them
+    guint workers = batch->count / STAT_BATCH < WORKERS_PER_FS - 1 ? batch->count / STAT_BATCH : WORKERS_PER_FS - 1;
+    for (guint w = 1; w < workers; w++)
+    {
+        backend_job *helper = job_new(JOB_STATAT, job->fsno, NULL);
+        if (helper == NULL)
+        {
             break;
         }
-        if ( args.res == -1 && args.errnum == ENOENT) {
-            continue; // Try next fs
-        } else if ( args.res == -1 && args.errnum != ENOENT) {
-            return - args.errnum;
-        }    
+        __atomic_add_fetch(&batch->refs, 1, __ATOMIC_RELAXED);
+        helper->batch = batch;
+        if (job_submit(helper) != 0) // Busy. Do it ourselves
+        {
+            helper->refs--;
+            job_unref(helper);
+            break;
+        }
+        job_unref(helper); // Runs even though nobody waits for it
     }
+    stat_batch_work(batch, 0);
+    stat_batch_unref(batch);
+}
 
-    if (all_timed_out) {
-        return -ETIMEDOUT;
+// Read all entries of job->path into job->entries, and their attributes with readdir_stat
+static int read_directory(backend_job *job)
+{
+    struct dirent *de;
+    DIR *dp = opendir(job->path);
+
+    if (dp == NULL)
+    {
+        return -1;
+    }
+    // Stat before reading, so a change while we read shows up as a new mtime next time
+    if (fstat(dirfd(dp), &job->st) == -1)
+    {
+        int errnum = errno;
+        closedir(dp);
+        errno = errnum;
+        return -1;
+    }
+    job->entries = g_ptr_array_new_with_free_func(dir_entry_free);
+    errno = 0;
+    while ((de = readdir(dp)) != NULL)
+    {
+        size_t len = strlen(de->d_name);
+        dir_entry *entry = malloc(sizeof(dir_entry) + len + 1);
+        if (entry == NULL)
+        {
+            closedir(dp);
+            errno = ENOMEM;
+            return -1;
+        }
+        entry->ino = de->d_ino;
+        entry->type = de->d_type;
+        entry->st = NULL;
+        memcpy(entry->name, de->d_name, len + 1);
+        g_ptr_array_add(job->entries, entry);
+    }
+    int errnum = errno;
+    if (errnum == 0 && Conf.readdir_stat)
+    {
+        stat_entries(job, dirfd(dp));
+    }
+    closedir(dp);
+    if (errnum != 0)
+    {
+        errno = errnum;
+        return -1;
     }
     return 0;
 }
 
+static void block_cache_fill(backend_job *job);
+static void job_harvest(backend_job *job);
 
+// Whether a failed call means the backend itself is in trouble, rather than the file
+static int backend_error(int errnum)
+{
+    switch (errnum)
+    {
+    case EIO:
+    case ETIMEDOUT:
+    case ENOTCONN:
+    case EHOSTDOWN:
+    case EHOSTUNREACH:
+    case ECONNRESET:
+        return 1;
+    }
+    return 0;
+}
 
-typedef struct arg_struct_read
+static void job_execute(backend_job *job)
 {
-    char *path;
-    int flags;
-    int res;
-    int errnum;
-    char *buf;
-    size_t size;
-    off_t offset;
-} arg_struct_read;
+    switch (job->type)
+    {
+    case JOB_LSTAT:
+        job->res = lstat(job->path, &job->st);
+        break;
+    case JOB_OPEN:
+        job->res = job->fd = open(job->path, job->flags);
+        job->owns_fd = 1;
+        if (job->fd != -1 && (Conf.cache_dir != NULL || Conf.consistency) && fstat(job->fd, &job->st) == -1)
+        {
+            job->st.st_size = -1; // Not cached, and no copy is the same as it
+        }
+        break;
+    case JOB_READ:
+        if (job->fd == -1)
+        {
+            job->fd = open(job->path, job->flags);
+            if (job->fd == -1)
+            {
+                job->res = -1;
+                break;
+            }
+            job->owns_fd = 1;
+            if (Conf.consistency && fstat(job->fd, &job->st) == -1)
+            {
+                job->st.st_size = -1; // The copy read from, see copy_matches
+            }
+        }
+        job->res = pread(job->fd, job->buf, job->size, job->offset);
+        break;
+    case JOB_READDIR:
+        job->res = read_directory(job);
+        break;
+    case JOB_CLOSE:
+        job->res = close(job->fd);
+        job->fd = -1;
+        break;
+    case JOB_FADVISE:
+        errno = posix_fadvise(job->fd, job->offset, job->size, job->flags);
+        job->res = errno == 0 ? 0 : -1;
+        break;
+    case JOB_CACHE_FILL:
+        block_cache_fill(job);
+        break;
+    case JOB_STATAT:
+        stat_batch_work(job->batch, 1);
+        job->res = 0;
+        break;
+    case JOB_READLINK:
+        job->res = readlink(job->path, job->buf, job->size);
+        break;
+    case JOB_STATFS:
+        job->res = statvfs(job->path, (struct statvfs *)job->buf);
+        break;
+    case JOB_ACCESS:
+        job->res = access(job->path, job->flags);
+        break;
+    case JOB_GETXATTR:
+        job->res = lgetxattr(job->path, job->name, job->buf, job->size);
+        break;
+    case JOB_LISTXATTR:
+        job->res = llistxattr(job->path, job->buf, job->size);
+        break;
+    }
+    if (job->res == -1)
+    {
+        job->errnum = errno;
+    }
+}
 
-void *thread_read(void *arguments)
+// Hand a finished job to its caller, record how it went and drop the worker's reference.
+// cancelled: the io_uring engine cancelled it after the caller gave up, which says nothing
+// about the backend
+static void job_complete(backend_job *job, int cancelled)
 {
-    arg_struct_read *args = (arg_struct_read *)arguments;
-    int fd = open(args->path, args->flags);
-    if (fd == -1)
+    backend_pool *pool = &Pools[job->fsno];
+    long us = elapsed_us(&job->submitted);
+
+    __atomic_sub_fetch(&pool->inflight, 1, __ATOMIC_RELAXED);
+    stats_backend_done(job->fsno, job->type, us, job->res == -1 && job->errnum != ENOENT);
+    if ((job->res != -1 || job->errnum == ENOENT) && job->type != JOB_CLOSE && job->type != JOB_FADVISE &&
+        job->type != JOB_CACHE_FILL && job->type != JOB_STATAT)
     {
-        args->errnum = errno;
-        args->res = fd;
-        return NULL;
+        health_record_latency(job->fsno, us);
     }
 
-    args->res = pread(fd, args->buf, args->size, args->offset); 
-    close(fd);
-    
-    if (args->res == -1)
+    pthread_mutex_lock(&job->lock);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    int timed_out = job->abandoned && !job->discarded;
+    // Only reads a caller waits for go into the hedge threshold, not prefetches or hedge losers
+    int sample = job->type == JOB_READ && !cancelled && !job->prefetch && !job->discarded;
+    if (timed_out)
     {
-        args->errnum = errno;
-        return NULL;
+        __atomic_sub_fetch(&pool->stuck, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&Stuck_total, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&pool->stuck_lock);
+        g_queue_unlink(&pool->stuck_jobs, &job->stuck_link);
+        pthread_mutex_unlock(&pool->stuck_lock);
     }
-    //args->res  = 0;
-    return NULL;
+    pthread_cond_broadcast(&job->cond);
+    if (job->group != NULL)
+    {
+        pthread_mutex_lock(&job->group->lock);
+        pthread_cond_broadcast(&job->group->cond);
+        pthread_mutex_unlock(&job->group->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+    if (sample)
+    {
+        record_read_latency(pool, us);
+    }
+
+    // A call that answers after its caller gave up already opened the breaker. Do not let
+    // it close it again, the next one would most likely time out as well
+    if (!cancelled && job->res == -1 && backend_error(job->errnum))
+    {
+        health_failure(job->fsno);
+    }
+    else if (!cancelled && !timed_out)
+    {
+        health_success(job->fsno);
+    }
+    if (timed_out && !cancelled)
+    {
+        count(COUNTER(late_calls));
+        job_harvest(job);
+    }
+    job_unref(job);
 }
 
-static int callback_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *finfo)
+void *backend_worker(void *fsno)
 {
-    (void)finfo;
-    
-   
-    char *ipath;
-    arg_struct_read args;
-    args.size = size;
-    args.offset = offset;
-    
-    args.flags = O_RDONLY;
+    backend_pool *pool = &Pools[(long)fsno];
 
-    for (int i = 0; i < Fscount; i++) 
+    while (1)
     {
-        args.buf = buf;
-        Currfs = Fss[i];
-        int fs_status = retrieve_from_hash_table(FSOkMap, Currfs);
-        if (fs_status == 0)
+        while (sem_wait(&pool->pending) != 0)
+        {
+            ; // EINTR
+        }
+        backend_job *job;
+        while ((job = job_dequeue(pool)) == NULL)
+        {
+            sched_yield(); // Slot claimed but not yet published
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (job->abandoned) // Nobody waits for it anymore
         {
+            pthread_mutex_unlock(&job->lock);
+            __atomic_sub_fetch(&pool->inflight, 1, __ATOMIC_RELAXED);
+            job_unref(job);
             continue;
         }
+        job->started = 1;
+        pthread_mutex_unlock(&job->lock);
 
-        pthread_t thread_id;
-        ipath = translate_path(path);
-        args.path = ipath;
-       
-        // Disabled due to to much spam ..
-        //DEBUG("CALLLBACK_READ %s\n", ipath);
+        job_execute(job);
+        job_complete(job, 0);
+    }
+    return NULL;
+}
 
-        pthread_create(&thread_id, NULL, thread_read, &args);
+#ifdef HAVE_IO_URING
+/******************************
+ *
+ * io_uring engine
+ *
+ * With -o io_engine=uring, stats, opens, reads on an open fd and closes go to one io_uring per
+ * backend instead of its workers, through the raw syscalls. Each call is linked to a timeout at
+ * the caller's deadline, so the kernel cancels it instead of a worker being stuck in it, and a
+ * call the caller gives up on is cancelled with ASYNC_CANCEL. One thread per ring reaps the
+ * completions and hands them over like a worker would (job_complete()). Listings, prefetch
+ * hints, cache fills and reads that have to open the file first still go to the workers, as
+ * does anything the ring has no room for.
+ *
+ ******************************/
 
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += 5; //  Timeout for reading one chunk of the file taken out of thin air
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096 // Calls in flight per backend before the kernel has to buffer
 
-        if (pthread_timedjoin_np(thread_id, NULL, &timeout) != 0) 
-        {
-            LOG("callback_read: read(%s) timed out. Trying next fs if any\n", ipath);
-            free(ipath);
-            continue;
+typedef struct uring
+{
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int tail;    // Next SQ tail, published by uring_flush()
+    pthread_mutex_t lock; // Submitters
+    pthread_t reaper;
+    int stop;             // Set by stop_uring(), the reaper exits at its next completion
+    char *rings;          // SQ and CQ rings, one mapping
+    size_t rings_size;
+    size_t sqes_size;
+} uring;
+
+uring *Urings = NULL; // One per backend with io_engine=uring, NULL otherwise
+
+// Whether the ring supports every op we use
+static int uring_probe(int fd)
+{
+    static const int ops[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE,
+                              IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL};
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    int ok = probe != NULL && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+// Unmap what uring_setup() mapped and close the ring
+static void uring_teardown(uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->rings != NULL && ring->rings != MAP_FAILED)
+    {
+        munmap(ring->rings, ring->rings_size);
+    }
+    close(ring->fd);
+}
+
+// Returns 0, or an errno value. Leaves nothing mapped or open on failure
+static int uring_setup(uring *ring)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if (ring->fd == -1)
+    {
+        return errno;
+    }
+    // Single mmap (5.4) and no dropped completions (5.5). Cheaper than handling older kernels
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ||
+        !uring_probe(ring->fd))
+    {
+        close(ring->fd);
+        return ENOSYS;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+    if (ring->rings != MAP_FAILED)
+    {
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+    }
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        int errnum = errno;
+        uring_teardown(ring);
+        return errnum;
+    }
+    char *rings = ring->rings;
+    ring->sq_head = (unsigned int *)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(rings + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned int *)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    ring->tail = *ring->sq_tail;
+    pthread_mutex_init(&ring->lock, NULL);
+    return 0;
+}
+
+// Next free submission entry, cleared. Called with ring->lock held. NULL if the SQ is full
+static struct io_uring_sqe *uring_sqe(uring *ring)
+{
+    if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        return NULL;
+    }
+    unsigned int index = ring->tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->tail++;
+    return sqe;
+}
+
+// Publish the new entries and have the kernel take them. Called with ring->lock held. Entries
+// the kernel did not take now are taken by the next flush or the reaper
+static void uring_flush(uring *ring)
+{
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+    unsigned int pending = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (pending > 0 && syscall(__NR_io_uring_enter, ring->fd, pending, 0, 0, NULL, 0) == -1 && errno == EINTR)
+    {
+        ;
+    }
+}
+
+// Whether the engine runs this job
+static int uring_handles(const backend_job *job)
+{
+    switch (job->type)
+    {
+    case JOB_LSTAT:
+    case JOB_CLOSE:
+        return 1;
+    case JOB_OPEN:
+        return Conf.cache_dir == NULL && !Conf.consistency; // These want an fstat with it
+    case JOB_READ:
+        return job->fd != -1;
+    default:
+        return 0;
+    }
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, backend_job *job)
+{
+    switch (job->type)
+    {
+    case JOB_LSTAT:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)job->path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uintptr_t)&job->stx;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        break;
+    case JOB_OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)job->path;
+        sqe->open_flags = job->flags;
+        break;
+    case JOB_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = job->fd;
+        sqe->addr = (uintptr_t)job->buf;
+        sqe->len = job->size;
+        sqe->off = job->offset;
+        break;
+    case JOB_CLOSE:
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = job->fd;
+        break;
+    default:
+        break;
+    }
+    sqe->user_data = (uintptr_t)job;
+}
+
+// Submit a job uring_handles(), with a timeout at job->deadline or the op class timeout.
+// Returns 0, or an errno value and the job was not submitted
+static int uring_submit(backend_job *job)
+{
+    uring *ring = &Urings[job->fsno];
+    unsigned int timeout_ms = job->type == JOB_LSTAT ? Conf.metadata_timeout :
+                              job->type == JOB_OPEN  ? Conf.open_timeout : Conf.read_timeout;
+    int linked = job->type != JOB_CLOSE; // A close has to happen, however long it takes
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + linked >= ring->sq_entries)
+    {
+        pthread_mutex_unlock(&ring->lock);
+        return EAGAIN;
+    }
+    job->uring = 1;
+    job->started = 1; // As far as job_release() is concerned
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    uring_prep(sqe, job);
+    if (linked)
+    {
+        struct io_uring_sqe *timeout = uring_sqe(ring);
+        sqe->flags |= IOSQE_IO_LINK;
+        timeout->opcode = IORING_OP_LINK_TIMEOUT;
+        timeout->fd = -1;
+        timeout->addr = (uintptr_t)&job->uring_timeout;
+        timeout->len = 1;
+        if (job->deadline.tv_sec != 0)
+        {
+            job->uring_timeout.tv_sec = job->deadline.tv_sec; // CLOCK_MONOTONIC like ours
+            job->uring_timeout.tv_nsec = job->deadline.tv_nsec;
+            timeout->timeout_flags = IORING_TIMEOUT_ABS;
+        }
+        else
+        {
+            job->uring_timeout.tv_sec = timeout_ms / 1000;
+            job->uring_timeout.tv_nsec = timeout_ms % 1000 * 1000000L;
+        }
+    }
+    uring_flush(ring);
+    pthread_mutex_unlock(&ring->lock);
+    count(COUNTER(uring_calls));
+    return 0;
+}
+
+// The caller gave up on a job it submitted to the ring. Best effort, the linked timeout ends it
+// otherwise. Called while the caller still holds its reference, so the job can not be reused
+static void uring_cancel(backend_job *job)
+{
+    uring *ring = &Urings[job->fsno];
+
+    pthread_mutex_lock(&ring->lock);
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)job;
+        uring_flush(ring);
+        count(COUNTER(uring_cancels));
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+// Fill in the job from a completion, like job_execute() would have
+static void uring_done(backend_job *job, int res)
+{
+    int cancelled = 0;
+
+    if (res < 0)
+    {
+        job->res = -1;
+        job->errnum = -res;
+        if (res == -ECANCELED)
+        {
+            pthread_mutex_lock(&job->lock);
+            cancelled = job->abandoned;
+            pthread_mutex_unlock(&job->lock);
+            if (!cancelled)
+            {
+                job->errnum = ETIMEDOUT; // The linked timeout fired
+            }
+        }
+    }
+    else
+    {
+        job->res = res;
+        switch (job->type)
+        {
+        case JOB_LSTAT:
+            statx_to_stat(&job->stx, &job->st);
+            break;
+        case JOB_OPEN:
+            job->fd = res;
+            job->owns_fd = 1;
+            break;
+        case JOB_CLOSE:
+            job->fd = -1;
+            break;
+        default:
+            break;
+        }
+    }
+    job_complete(job, cancelled);
+}
+
+void *uring_reaper(void *fsno)
+{
+    uring *ring = &Urings[(long)fsno];
+
+    while (!__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE))
+    {
+        unsigned int head = *ring->cq_head; // Only written here
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            // Also takes entries a submitter's flush left behind
+            unsigned int pending = __atomic_load_n(ring->sq_tail, __ATOMIC_ACQUIRE) -
+                                   __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+            if (syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+                errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                LOG("uring_reaper: io_uring_enter on %s: %s\n", Fss[(long)fsno], strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        backend_job *job = (backend_job *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (job != NULL) // Not a linked timeout or a cancel
+        {
+            uring_done(job, res);
+        }
+    }
+    return NULL;
+}
+
+// Set up a ring per backend, or leave Urings NULL so everything runs on the workers
+static void start_uring(void)
+{
+    if (Conf.io_engine == NULL || strcmp(Conf.io_engine, "uring") != 0)
+    {
+        return;
+    }
+    uring *rings = calloc(Fscount, sizeof(uring));
+    if (rings == NULL)
+    {
+        return;
+    }
+    for (long i = 0; i < Fscount; i++)
+    {
+        int errnum = uring_setup(&rings[i]);
+        if (errnum != 0)
+        {
+            LOG("start_uring: io_uring not usable (%s). Using worker threads\n", strerror(errnum));
+            for (long j = 0; j < i; j++)
+            {
+                uring_teardown(&rings[j]);
+            }
+            free(rings);
+            return;
+        }
+    }
+    Urings = rings;
+    for (long i = 0; i < Fscount; i++)
+    {
+        if (pthread_create(&Urings[i].reaper, NULL, uring_reaper, (void *)i) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+}
+
+// Stop the reapers and close the rings, at unmount. Calls still in flight are not waited for,
+// nobody is left to wait on them
+static void stop_uring(void)
+{
+    if (Urings == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < Fscount; i++)
+    {
+        uring *ring = &Urings[i];
+
+        __atomic_store_n(&ring->stop, 1, __ATOMIC_RELEASE);
+        // A no-op completion wakes the reaper. With the SQ full the pending entries do
+        pthread_mutex_lock(&ring->lock);
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+        if (sqe != NULL)
+        {
+            sqe->opcode = IORING_OP_NOP;
+            sqe->fd = -1;
+            uring_flush(ring);
+        }
+        pthread_mutex_unlock(&ring->lock);
+    }
+    for (int i = 0; i < Fscount; i++)
+    {
+        pthread_join(Urings[i].reaper, NULL);
+    }
+    uring *rings = Urings;
+    Urings = NULL;
+    for (int i = 0; i < Fscount; i++)
+    {
+        uring_teardown(&rings[i]);
+        pthread_mutex_destroy(&rings[i].lock);
+    }
+    free(rings);
+}
+#else
+static void start_uring(void)
+{
+    if (Conf.io_engine != NULL && strcmp(Conf.io_engine, "uring") == 0)
+    {
+        LOG("start_uring: Built without io_uring. Using worker threads\n");
+    }
+}
+
+static void stop_uring(void)
+{
+}
+#endif
+
+// Queue a job on its backend. Returns 0, or an errno value if the job was not queued: EBUSY
+// when the backend already has max_inflight calls or its queue is full, so the caller tries
+// another replica now, ETIMEDOUT when it has too many stuck calls
+static int job_submit(backend_job *job)
+{
+    backend_pool *pool = &Pools[job->fsno];
+    int stuck = __atomic_load_n(&pool->stuck, __ATOMIC_RELAXED);
+
+    // Past the global cap only backends without stuck calls are still tried
+    if (stuck >= MAX_STUCK_PER_FS ||
+        (stuck > 0 && Conf.max_stuck > 0 && __atomic_load_n(&Stuck_total, __ATOMIC_RELAXED) >= (int)Conf.max_stuck))
+    {
+        return ETIMEDOUT;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+    if (Conf.max_inflight > 0 && !job->unlimited)
+    {
+        // Take a slot with a CAS, so concurrent submitters can not go over the limit
+        int n = __atomic_load_n(&pool->inflight, __ATOMIC_RELAXED);
+        do
+        {
+            if (n >= (int)Conf.max_inflight)
+            {
+                __atomic_add_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+                return EBUSY;
+            }
+        } while (!__atomic_compare_exchange_n(&pool->inflight, &n, n + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    else
+    {
+        __atomic_add_fetch(&pool->inflight, 1, __ATOMIC_RELAXED);
+    }
+    job->queued = 1;
+#ifdef HAVE_IO_URING
+    if (Urings != NULL && uring_handles(job) && uring_submit(job) == 0)
+    {
+        return 0;
+    }
+#endif
+    if (job_enqueue(pool, job) != 0)
+    {
+        job->queued = 0;
+        __atomic_sub_fetch(&pool->inflight, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+        return EBUSY;
+    }
+    sem_post(&pool->pending);
+    return 0;
+}
+
+// Close an fd on a backend without waiting for it, since close() on a dead NFS/CIFS server may
+// hang as well
+static void close_backend_fd(int fsno, int fd)
+{
+    if (fd == -1)
+    {
+        return;
+    }
+    backend_job *job = job_new(JOB_CLOSE, fsno, NULL);
+    if (job == NULL)
+    {
+        close(fd);
+        return;
+    }
+    job->fd = fd;
+    int rc = job_submit(job);
+    if (rc != 0)
+    {
+        job->refs--;
+    }
+    job_unref(job); // Runs even though nobody waits for it
+    if (rc == ETIMEDOUT)
+    {
+        // Backend is stuck. Leak the fd rather than block this thread
+        LOG("close_backend_fd: Leaking fd %d on %s\n", fd, Fss[fsno]);
+    }
+    else if (rc != 0)
+    {
+        close(fd); // Only the queue is full
+    }
+}
+
+// Share fd, open on backend fsno, with one reference for the caller. Returns NULL when out of
+// memory, the fd is closed then
+static backend_fd *backend_fd_new(int fsno, int fd)
+{
+    backend_fd *bfd = malloc(sizeof(backend_fd));
+    if (bfd == NULL)
+    {
+        close_backend_fd(fsno, fd);
+        return NULL;
+    }
+    bfd->fsno = fsno;
+    bfd->fd = fd;
+    bfd->refs = 1;
+    return bfd;
+}
+
+// Take a reference, for as long as the fd is used outside the lock it was found under
+static backend_fd *backend_fd_get(backend_fd *bfd)
+{
+    if (bfd != NULL)
+    {
+        __atomic_add_fetch(&bfd->refs, 1, __ATOMIC_RELAXED);
+    }
+    return bfd;
+}
+
+// Drop a reference. The last one closes the fd on its backend
+static void backend_fd_put(backend_fd *bfd)
+{
+    if (bfd == NULL || __atomic_sub_fetch(&bfd->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+    close_backend_fd(bfd->fsno, bfd->fd);
+    free(bfd);
+}
+
+// End of the request budget of the FUSE request this thread is serving, monotonic_us(). 0 => none
+static __thread long long Request_deadline = 0;
+
+static long long monotonic_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Start the request_timeout budget for the FUSE request this thread is about to serve. All
+// backend calls it makes, on whichever replica, have to fit in it
+static void request_begin(void)
+{
+    Request_deadline = Conf.request_timeout ? monotonic_us() + Conf.request_timeout * 1000LL : 0;
+}
+
+// Whether the request budget is used up, so there is no point trying another replica
+static int request_expired(void)
+{
+    return Request_deadline != 0 && monotonic_us() >= Request_deadline;
+}
+
+// Absolute CLOCK_MONOTONIC deadline timeout_ms milliseconds from now, or the end of the request
+// budget if that comes first
+static void deadline_in(struct timespec *deadline, unsigned int timeout_ms)
+{
+    long long us = monotonic_us() + timeout_ms * 1000LL;
+
+    if (Request_deadline != 0 && Request_deadline < us)
+    {
+        us = Request_deadline;
+    }
+    deadline->tv_sec = us / 1000000;
+    deadline->tv_nsec = us % 1000000 * 1000;
+}
+
+// A wait on a deadline from deadline_in() timed out. counter is the op class's deadline misses
+static void deadline_missed(size_t counter)
+{
+    count(counter);
+    if (request_expired())
+    {
+        count(COUNTER(request_deadline_misses));
+    }
+}
+
+// Wait for a submitted job until the deadline. Returns 0 when the job has completed, otherwise
+// ETIMEDOUT
+static int job_wait(backend_job *job, const struct timespec *deadline)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->done && rc == 0)
+    {
+        rc = pthread_cond_timedwait(&job->cond, &job->lock, deadline);
+    }
+    rc = job->done ? 0 : ETIMEDOUT;
+    pthread_mutex_unlock(&job->lock);
+    return rc;
+}
+
+// Submit a job and wait for it until the deadline. Returns 0 when the job has completed,
+// otherwise ETIMEDOUT (or the submit error) and the job must still be released with job_put()
+static int job_run(backend_job *job, const struct timespec *deadline)
+{
+    job->deadline = *deadline;
+    int rc = job_submit(job);
+    if (rc != 0)
+    {
+        job->refs--; // Never reached a worker
+        return rc;
+    }
+    return job_wait(job, deadline);
+}
+
+static void job_release(backend_job *job, int discard)
+{
+    int cancel = 0;
+
+    pthread_mutex_lock(&job->lock);
+    job->group = NULL;
+    if (!job->done && !job->abandoned)
+    {
+        job->abandoned = 1;
+        job->discarded = discard;
+#ifdef HAVE_IO_URING
+        cancel = job->uring;
+#endif
+        if (job->started && !discard)
+        {
+            backend_pool *pool = &Pools[job->fsno];
+            __atomic_add_fetch(&pool->stuck, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&Stuck_total, 1, __ATOMIC_RELAXED);
+            job->stuck_link.data = job;
+            pthread_mutex_lock(&pool->stuck_lock);
+            g_queue_push_tail_link(&pool->stuck_jobs, &job->stuck_link);
+            pthread_mutex_unlock(&pool->stuck_lock);
+            // Let replica selection know, the call itself may never return
+            health_record_latency(job->fsno, elapsed_us(&job->submitted));
+        }
+    }
+    // Timed out, whether a worker got to it or not
+    int failed = job->queued && !job->done && !discard;
+    pthread_mutex_unlock(&job->lock);
+    if (failed)
+    {
+        health_failure(job->fsno);
+    }
+#ifdef HAVE_IO_URING
+    if (cancel)
+    {
+        uring_cancel(job);
+    }
+#endif
+    job_unref(job);
+}
+
+// Microseconds the oldest stuck call on backend fsno has been running, 0 if there is none
+static long stuck_oldest_us(int fsno)
+{
+    backend_pool *pool = &Pools[fsno];
+    long oldest = 0;
+
+    pthread_mutex_lock(&pool->stuck_lock);
+    for (GList *link = pool->stuck_jobs.head; link != NULL; link = link->next)
+    {
+        long us = elapsed_us(&((backend_job *)link->data)->submitted);
+        oldest = us > oldest ? us : oldest;
+    }
+    pthread_mutex_unlock(&pool->stuck_lock);
+    return oldest;
+}
+
+// Release the caller's reference. A job that has not completed yet is abandoned
+static void job_put(backend_job *job)
+{
+    job_release(job, 0);
+}
+
+// Like job_put(), for a job whose result is no longer wanted although its backend is fine
+static void job_discard(backend_job *job)
+{
+    job_release(job, 1);
+}
+
+static void job_group_init(job_group *group)
+{
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->cond, &Job_condattr);
+}
+
+static void job_group_destroy(job_group *group)
+{
+    pthread_cond_destroy(&group->cond);
+    pthread_mutex_destroy(&group->lock);
+}
+
+// Submit a job that signals group when it completes
+static int job_submit_group(backend_job *job, job_group *group)
+{
+    job->group = group;
+    int rc = job_submit(job);
+    if (rc != 0)
+    {
+        job->group = NULL;
+        job->refs--; // Never reached a worker
+    }
+    return rc;
+}
+
+// Wait until one of the n jobs (NULL entries are skipped) completes or the deadline passes.
+// Returns the index of a completed job, or -1 on timeout
+static int job_wait_any(job_group *group, backend_job **jobs, int n, const struct timespec *deadline)
+{
+    int rc = 0;
+    pthread_mutex_lock(&group->lock);
+    while (1)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (jobs[i] != NULL && __atomic_load_n(&jobs[i]->done, __ATOMIC_ACQUIRE))
+            {
+                pthread_mutex_unlock(&group->lock);
+                return i;
+            }
+        }
+        if (rc != 0)
+        {
+            break;
+        }
+        rc = pthread_cond_timedwait(&group->cond, &group->lock, deadline);
+    }
+    pthread_mutex_unlock(&group->lock);
+    return -1;
+}
+
+// Microseconds to wait on backend fsno before hedging a read
+static long hedge_delay_us(int fsno)
+{
+    if (Conf.hedge_delay)
+    {
+        return Conf.hedge_delay * 1000L;
+    }
+    long us = __atomic_load_n(&Pools[fsno].hedge_threshold, __ATOMIC_RELAXED);
+    if (us == 0)
+    {
+        return HEDGE_DEFAULT_MS * 1000L;
+    }
+    return us < HEDGE_MIN_US ? HEDGE_MIN_US : us;
+}
+
+static void start_backend_pools(void)
+{
+    pthread_condattr_init(&Job_condattr);
+    pthread_condattr_setclock(&Job_condattr, CLOCK_MONOTONIC);
+
+    if (posix_memalign((void **)&Pools, 64, Fscount * sizeof(backend_pool)) != 0)
+    {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(Pools, 0, Fscount * sizeof(backend_pool));
+    for (long i = 0; i < Fscount; i++)
+    {
+        backend_pool *pool = &Pools[i];
+        for (size_t s = 0; s < JOB_QUEUE_SIZE; s++)
+        {
+            pool->slots[s].seq = s;
+        }
+        sem_init(&pool->pending, 0, 0);
+        pthread_mutex_init(&pool->stuck_lock, NULL);
+        for (int w = 0; w < WORKERS_PER_FS; w++)
+        {
+            if (pthread_create(&pool->workers[w], NULL, backend_worker, (void *)i) != 0)
+            {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+    }
+}
+
+
+/******************************
+ *
+ * Replica selection
+ *
+ * Which replica a request goes to first. Replicas are grouped in priority tiers (path:prio on
+ * the command line), and a lower tier is only tried when every replica of the better ones is
+ * blocked or did not have the answer. Within a tier, "ordered" keeps the order given on the
+ * command line, "ewma" prefers the lowest latency EWMA (fed by the monitor probes and by
+ * completed calls), "p2c" picks the better of two random replicas by latency times calls in
+ * flight, so load is spread over replicas that are about as fast. Weights (path:prio:weight)
+ * divide the cost, and make p2c draw a replica more often.
+ *
+ ******************************/
+
+#define POLICY_ORDERED 0
+#define POLICY_EWMA 1
+#define POLICY_P2C 2
+
+static __thread unsigned int Selection_seed;
+
+// Lower is better within a tier
+static unsigned long replica_cost(int fsno)
+{
+    if (Conf.policy == POLICY_ORDERED)
+    {
+        return 0;
+    }
+    unsigned long latency = __atomic_load_n(&Health[fsno].latency_ewma, __ATOMIC_RELAXED);
+    if (Conf.policy == POLICY_P2C)
+    {
+        latency = (latency + 1) * (__atomic_load_n(&Pools[fsno].inflight, __ATOMIC_RELAXED) + 1);
+    }
+    return latency / Fsweight[fsno];
+}
+
+// Whether replica a goes before b: up before blocked, then by tier, then by cost
+static int replica_before(int a, int b, const int *blocked, const unsigned long *cost)
+{
+    if (blocked[a] != blocked[b])
+    {
+        return blocked[b];
+    }
+    if (Fsprio[a] != Fsprio[b])
+    {
+        return Fsprio[a] < Fsprio[b];
+    }
+    return cost[a] < cost[b];
+}
+
+// One of the n candidates, drawn by weight
+static int weighted_pick(const int *candidates, int n)
+{
+    unsigned long total = 0;
+    for (int k = 0; k < n; k++)
+    {
+        total += Fsweight[candidates[k]];
+    }
+    unsigned long r = rand_r(&Selection_seed) % total;
+    for (int k = 0; k < n - 1; k++)
+    {
+        if (r < Fsweight[candidates[k]])
+        {
+            return k;
+        }
+        r -= Fsweight[candidates[k]];
+    }
+    return n - 1;
+}
+
+// Fill order[Fscount] with the replicas to try for one request, best first
+static void replica_order(int *order)
+{
+    unsigned long cost[Fscount];
+    int blocked[Fscount];
+    int candidates[Fscount]; // Replicas in the best tier that is up
+    int ncandidates = 0;
+
+    for (int i = 0; i < Fscount; i++)
+    {
+        order[i] = i;
+        blocked[i] = fs_blocks(i);
+        cost[i] = replica_cost(i);
+        if (blocked[i])
+        {
+            continue;
+        }
+        if (ncandidates > 0 && Fsprio[i] < Fsprio[candidates[0]])
+        {
+            ncandidates = 0;
+        }
+        if (ncandidates == 0 || Fsprio[i] == Fsprio[candidates[0]])
+        {
+            candidates[ncandidates++] = i;
+        }
+    }
+
+    if (Conf.policy == POLICY_P2C && ncandidates > 2)
+    {
+        // Two random candidates, the better one goes first. The rest by cost
+        if (Selection_seed == 0)
+        {
+            Selection_seed = (unsigned int)pthread_self() ^ (unsigned int)monotonic_ms();
+        }
+        int k = weighted_pick(candidates, ncandidates);
+        int a = candidates[k];
+        candidates[k] = candidates[--ncandidates];
+        int b = candidates[weighted_pick(candidates, ncandidates)];
+        int first = cost[b] < cost[a] ? b : a;
+        order[first] = 0;
+        order[0] = first;
+        cost[first] = 0; // Keeps it first in the sort below
+    }
+
+    // Stable insertion sort, Fscount is small
+    for (int i = 1; i < Fscount; i++)
+    {
+        int fsno = order[i];
+        int j = i;
+        while (j > 0 && replica_before(fsno, order[j - 1], blocked, cost))
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = fsno;
+    }
+}
+
+// Replica for calls made directly from the FUSE thread
+static int preferred_replica(void)
+{
+    int order[Fscount];
+    replica_order(order);
+    return order[0];
+}
+
+static int parse_replica_policy(const char *name)
+{
+    if (name == NULL || strcmp(name, "ewma") == 0)
+    {
+        return POLICY_EWMA;
+    }
+    if (strcmp(name, "ordered") == 0)
+    {
+        return POLICY_ORDERED;
+    }
+    if (strcmp(name, "p2c") == 0)
+    {
+        return POLICY_P2C;
+    }
+    return -1;
+}
+
+/******************************
+ *
+ * Attribute cache
+ *
+ * getattr results keyed by path, including paths missing on every replica (negative entries),
+ * so repeated stats of the same files do not cost a round trip to each backend.
+ * Bounded by attr_cache_size, least recently used entries are evicted first.
+ *
+ ******************************/
+
+typedef struct attr_entry
+{
+    char *path; // Also the key in AttrCache
+    struct stat st;
+    int errnum; // 0 => st is valid, otherwise the path does not exist
+    int fsno;   // Replica whose copy st is, when chosen by consistent_getattr. Otherwise -1
+    long long expires; // monotonic_ms()
+    GList lru;  // Link in AttrLru, most recently used first
+} attr_entry;
+
+GHashTable *AttrCache = NULL;
+static GQueue AttrLru = G_QUEUE_INIT;
+static pthread_mutex_t AttrLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void attr_entry_free(void *data)
+{
+    attr_entry *entry = (attr_entry *)data;
+    g_queue_unlink(&AttrLru, &entry->lru);
+    free(entry->path);
+    free(entry);
+}
+
+// Returns 1 and fills st (or errnum for a negative entry) if path is cached and not expired.
+// fsno, if not NULL, gets the replica st came from (see attr_entry)
+static int attr_cache_lookup(const char *path, struct stat *st, int *errnum, int *fsno)
+{
+    attr_entry *entry;
+    int hit = 0;
+
+    if (AttrCache == NULL)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&AttrLock);
+    entry = g_hash_table_lookup(AttrCache, path);
+    if (entry != NULL && entry->expires <= monotonic_ms())
+    {
+        g_hash_table_remove(AttrCache, path);
+        entry = NULL;
+    }
+    if (entry != NULL)
+    {
+        if (entry->errnum == 0)
+        {
+            *st = entry->st;
+        }
+        *errnum = entry->errnum;
+        if (fsno != NULL)
+        {
+            *fsno = entry->fsno;
+        }
+        g_queue_unlink(&AttrLru, &entry->lru);
+        g_queue_push_head_link(&AttrLru, &entry->lru);
+        hit = 1;
+    }
+    pthread_mutex_unlock(&AttrLock);
+    count(hit ? COUNTER(attr_cache_hits) : COUNTER(attr_cache_misses));
+    return hit;
+}
+
+// Cache st for path, or a negative entry if st is NULL. fsno: see attr_entry
+static void attr_cache_store(const char *path, const struct stat *st, int errnum, int fsno)
+{
+    double ttl = st != NULL ? Conf.attr_cache_ttl : Conf.attr_cache_negative_ttl;
+    attr_entry *entry;
+
+    if (AttrCache == NULL || ttl <= 0)
+    {
+        return;
+    }
+    entry = calloc(1, sizeof(attr_entry));
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->path = strdup(path);
+    if (entry->path == NULL)
+    {
+        free(entry);
+        return;
+    }
+    if (st != NULL)
+    {
+        entry->st = *st;
+    }
+    entry->errnum = st != NULL ? 0 : errnum;
+    entry->fsno = fsno;
+    entry->expires = monotonic_ms() + (long long)(ttl * 1000);
+    entry->lru.data = entry;
+
+    pthread_mutex_lock(&AttrLock);
+    g_hash_table_remove(AttrCache, path);
+    g_queue_push_head_link(&AttrLru, &entry->lru);
+    g_hash_table_insert(AttrCache, entry->path, entry);
+    while (g_hash_table_size(AttrCache) > Conf.attr_cache_size)
+    {
+        attr_entry *oldest = g_queue_peek_tail(&AttrLru);
+        g_hash_table_remove(AttrCache, oldest->path);
+    }
+    pthread_mutex_unlock(&AttrLock);
+}
+
+// Cache st for path unless an answer for it is cached already. For calls that returned after
+// their caller gave up, whose answer is older than the one that was used. Returns 1 if stored
+static int attr_cache_offer(const char *path, const struct stat *st)
+{
+    int cached;
+
+    if (AttrCache == NULL)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&AttrLock);
+    attr_entry *entry = g_hash_table_lookup(AttrCache, path);
+    cached = entry != NULL && entry->expires > monotonic_ms();
+    pthread_mutex_unlock(&AttrLock);
+    if (!cached)
+    {
+        attr_cache_store(path, st, 0, -1);
+    }
+    return !cached;
+}
+
+static void start_attr_cache(void)
+{
+    if (Conf.attr_cache_size == 0 || (Conf.attr_cache_ttl <= 0 && Conf.attr_cache_negative_ttl <= 0))
+    {
+        return;
+    }
+    AttrCache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, attr_entry_free);
+}
+
+/******************************
+ *
+ * Location index
+ *
+ * Which replicas hold a path and which do not, for paths that are missing on some replica. In
+ * parallel production a new file is often on one site only for a while, and trying the other
+ * one first costs a round trip on every getattr, open and reopen. Learned from getattr answers
+ * and from directory listings, which are re-read when the directory's mtime changes. It only
+ * reorders the replicas to try, so a stale entry costs time, never a wrong answer: entries
+ * expire after location_cache_ttl and are dropped when a holder says ENOENT. Bounded by
+ * location_cache_size, least recently used entries are evicted first.
+ *
+ ******************************/
+
+#define LOC_BITS (8 * sizeof(unsigned long))
+#define LOC_SET(bits, i) ((bits)[(i) / LOC_BITS] |= 1UL << ((i) % LOC_BITS))
+#define LOC_TEST(bits, i) (((bits)[(i) / LOC_BITS] >> ((i) % LOC_BITS)) & 1)
+
+typedef struct location_entry
+{
+    char *path; // Also the key in LocationIndex
+    long long expires; // monotonic_ms()
+    GList lru;  // Link in LocationLru, most recently used first
+    unsigned long bits[]; // Present on, then missing on: LocWords each
+} location_entry;
+
+static GHashTable *LocationIndex = NULL;
+static GQueue LocationLru = G_QUEUE_INIT;
+static pthread_mutex_t LocationLock = PTHREAD_MUTEX_INITIALIZER;
+static int LocWords; // unsigned longs per bitmap
+
+static void location_entry_free(void *data)
+{
+    location_entry *entry = (location_entry *)data;
+    g_queue_unlink(&LocationLru, &entry->lru);
+    free(entry->path);
+    free(entry);
+}
+
+// Move the replicas known to hold path to the front of order[Fscount] and those known to
+// lack it to the back, keeping the order otherwise. Returns how many were moved to the front
+static int location_order(const char *path, int *order)
+{
+    int hit = 0;
+
+    if (LocationIndex == NULL)
+    {
+        return 0;
+    }
+    unsigned long bits[2 * LocWords];
+    pthread_mutex_lock(&LocationLock);
+    location_entry *entry = g_hash_table_lookup(LocationIndex, path);
+    if (entry != NULL && entry->expires <= monotonic_ms())
+    {
+        g_hash_table_remove(LocationIndex, path);
+        entry = NULL;
+    }
+    if (entry != NULL)
+    {
+        memcpy(bits, entry->bits, sizeof(bits));
+        g_queue_unlink(&LocationLru, &entry->lru);
+        g_queue_push_head_link(&LocationLru, &entry->lru);
+        hit = 1;
+    }
+    pthread_mutex_unlock(&LocationLock);
+    count(hit ? COUNTER(location_hits) : COUNTER(location_misses));
+    if (!hit)
+    {
+        return 0;
+    }
+
+    int sorted[Fscount];
+    int n = 0;
+    int holders = 0;
+    for (int rank = 0; rank < 3; rank++) // Present, unknown, missing
+    {
+        for (int k = 0; k < Fscount; k++)
+        {
+            int i = order[k];
+            int r = LOC_TEST(bits, i) ? 0 : LOC_TEST(bits + LocWords, i) ? 2 : 1;
+            if (r == rank)
+            {
+                sorted[n++] = i;
+                holders += r == 0;
+            }
+        }
+    }
+    memcpy(order, sorted, sizeof(sorted));
+    return holders;
+}
+
+// Remember that path is on the replicas in present and not on those in missing. Both have
+// LocWords words. Called with LocationLock held
+static void location_store_locked(const char *path, const unsigned long *present, const unsigned long *missing)
+{
+    location_entry *entry = malloc(sizeof(location_entry) + 2 * LocWords * sizeof(unsigned long));
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->path = strdup(path);
+    if (entry->path == NULL)
+    {
+        free(entry);
+        return;
+    }
+    memcpy(entry->bits, present, LocWords * sizeof(unsigned long));
+    memcpy(entry->bits + LocWords, missing, LocWords * sizeof(unsigned long));
+    entry->expires = monotonic_ms() + (long long)(Conf.location_cache_ttl * 1000);
+    entry->lru.data = entry;
+
+    g_hash_table_remove(LocationIndex, path);
+    g_queue_push_head_link(&LocationLru, &entry->lru);
+    g_hash_table_insert(LocationIndex, entry->path, entry);
+    while (g_hash_table_size(LocationIndex) > Conf.location_cache_size)
+    {
+        location_entry *oldest = g_queue_peek_tail(&LocationLru);
+        g_hash_table_remove(LocationIndex, oldest->path);
+    }
+}
+
+// Learned from getattr, where the replicas in missing answered ENOENT and fsno had the path
+static void location_store(const char *path, int fsno, const unsigned long *missing)
+{
+    if (LocationIndex == NULL)
+    {
+        return;
+    }
+    unsigned long present[LocWords];
+    memset(present, 0, sizeof(present));
+    LOC_SET(present, fsno);
+    pthread_mutex_lock(&LocationLock);
+    location_store_locked(path, present, missing);
+    pthread_mutex_unlock(&LocationLock);
+}
+
+// A replica the index named as holder did not have path after all
+static void location_forget(const char *path)
+{
+    if (LocationIndex == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&LocationLock);
+    if (g_hash_table_remove(LocationIndex, path))
+    {
+        count(COUNTER(location_stale));
+    }
+    pthread_mutex_unlock(&LocationLock);
+}
+
+// Learn from the listings of directory path, listed[i] being replica i's entries or NULL if it
+// did not answer. Names on only some of the replicas that answered are stored, entries of names
+// now on all of them are dropped
+static void location_learn_listing(const char *path, GPtrArray **listed)
+{
+    guint total = 0;
+    int nanswered = 0;
+
+    if (LocationIndex == NULL)
+    {
+        return;
+    }
+    unsigned long answered[LocWords];
+    memset(answered, 0, sizeof(answered));
+    for (int i = 0; i < Fscount; i++)
+    {
+        if (listed[i] != NULL)
+        {
+            LOC_SET(answered, i);
+            total += listed[i]->len;
+            nanswered++;
+        }
+    }
+    if (nanswered < 2)
+    {
+        return;
+    }
+
+    // Name => 1 + its index in present, which has LocWords words per name
+    GHashTable *names = g_hash_table_new(g_str_hash, g_str_equal);
+    unsigned long *present = calloc((size_t)total * LocWords + 1, sizeof(unsigned long));
+    const char **name_of = malloc((total + 1) * sizeof(char *));
+    guint nnames = 0;
+    if (present == NULL || name_of == NULL)
+    {
+        g_hash_table_destroy(names);
+        free(present);
+        free(name_of);
+        return;
+    }
+    for (int i = 0; i < Fscount; i++)
+    {
+        for (guint e = 0; listed[i] != NULL && e < listed[i]->len; e++)
+        {
+            dir_entry *de = g_ptr_array_index(listed[i], e);
+            guint n = GPOINTER_TO_UINT(g_hash_table_lookup(names, de->name));
+            if (n == 0)
+            {
+                name_of[nnames] = de->name;
+                n = ++nnames;
+                g_hash_table_insert(names, de->name, GUINT_TO_POINTER(n));
+            }
+            LOC_SET(present + (size_t)(n - 1) * LocWords, i);
+        }
+    }
+
+    char child[PATH_MAX];
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    pthread_mutex_lock(&LocationLock);
+    for (guint n = 0; n < nnames; n++)
+    {
+        unsigned long *bits = present + (size_t)n * LocWords;
+        unsigned long missing[LocWords];
+        int partial = 0;
+
+        if (strcmp(name_of[n], ".") == 0 || strcmp(name_of[n], "..") == 0 ||
+            snprintf(child, sizeof(child), "%.*s/%s", (int)len, path, name_of[n]) >= (int)sizeof(child))
+        {
+            continue;
+        }
+        for (int w = 0; w < LocWords; w++)
+        {
+            missing[w] = answered[w] & ~bits[w];
+            partial |= missing[w] != 0;
+        }
+        if (partial)
+        {
+            location_store_locked(child, bits, missing);
+        }
+        else
+        {
+            g_hash_table_remove(LocationIndex, child);
+        }
+    }
+    pthread_mutex_unlock(&LocationLock);
+    g_hash_table_destroy(names);
+    free(present);
+    free(name_of);
+}
+
+static void start_location_index(void)
+{
+    LocWords = (Fscount + LOC_BITS - 1) / LOC_BITS;
+    if (Conf.location_cache_size == 0 || Conf.location_cache_ttl <= 0 || Fscount < 2)
+    {
+        return;
+    }
+    LocationIndex = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, location_entry_free);
+}
+
+/******************************
+ *
+ * Consistency
+ *
+ * With parallel production a path can be at different stages of being written on each site. With
+ * -o consistency a getattr of a file asks all healthy replicas at once and compares the copies.
+ * A copy not modified for consistency_settle seconds counts as complete. The newest complete copy
+ * wins, or the newest one if none is complete, and the first replica in the usual order that has
+ * the same copy answers. When the first replica's copy is complete it answers right away, compared
+ * only with the copies of the replicas that answered before it. The attr cache remembers that
+ * replica for open to pin the file on, and a read only fails over to a replica whose copy is the
+ * same as the pinned one.
+ *
+ * The sites write their copies independently, so mtimes never match exactly: two complete copies
+ * are the same if their sizes are.
+ *
+ ******************************/
+
+#define CONSISTENCY_SETTLE_DEFAULT 2 // Seconds
+
+// Whether the copy with attributes st has not been modified for consistency_settle seconds
+static int copy_complete(const struct stat *st, const struct timespec *now)
+{
+    double age = (now->tv_sec - st->st_mtim.tv_sec) + (now->tv_nsec - st->st_mtim.tv_nsec) / 1e9;
+    return age >= Conf.consistency_settle;
+}
+
+// Whether a and b are the same copy of a file. Anything but two files counts as the same
+static int same_copy(const struct stat *a, const struct stat *b, const struct timespec *now)
+{
+    if (!S_ISREG(a->st_mode) || !S_ISREG(b->st_mode))
+    {
+        return 1;
+    }
+    if (a->st_size != b->st_size)
+    {
+        return 0;
+    }
+    if (a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec)
+    {
+        return 1;
+    }
+    return copy_complete(a, now) && copy_complete(b, now);
+}
+
+// Whether copy a is a better one to read than b: complete before being written, then newest,
+// then biggest
+static int copy_better(const struct stat *a, const struct stat *b, const struct timespec *now)
+{
+    if (!S_ISREG(a->st_mode) || !S_ISREG(b->st_mode))
+    {
+        return 0;
+    }
+    int a_complete = copy_complete(a, now);
+    int b_complete = copy_complete(b, now);
+    if (a_complete != b_complete)
+    {
+        return a_complete;
+    }
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec)
+    {
+        return a->st_mtim.tv_sec > b->st_mtim.tv_sec;
+    }
+    if (a->st_mtim.tv_nsec != b->st_mtim.tv_nsec)
+    {
+        return a->st_mtim.tv_nsec > b->st_mtim.tv_nsec;
+    }
+    return a->st_size > b->st_size;
+}
+
+// getattr with consistency: lstat path on every healthy replica at once and answer with the chosen
+// copy. Its replica goes to *fsno and the attr cache. Returns 0 or -errno like callback_getattr.
+// Once the preferred replica has a complete copy it answers without waiting for the rest: a copy
+// still being written elsewhere ranks below it, and complete copies of one production run are the
+// same. Otherwise all are waited for, up to metadata_timeout
+static int consistent_getattr(const char *path, struct stat *st_data, int *fsno)
+{
+    int order[Fscount];
+    backend_job *jobs[Fscount];
+    struct stat sts[Fscount];
+    int found[Fscount];
+    unsigned long missing[LocWords]; // Replicas that answered ENOENT
+    int nmissing = 0;
+    int answered = 0;
+    int pending = 0;
+    int preferred = -1; // Index of the first replica asked
+    int errnum = ETIMEDOUT;
+    struct timespec deadline, now;
+    job_group group;
+
+    replica_order(order);
+    int holders = location_order(path, order);
+    memset(missing, 0, sizeof(missing));
+    deadline_in(&deadline, Conf.metadata_timeout);
+    job_group_init(&group);
+    for (int n = 0; n < Fscount; n++)
+    {
+        int i = order[n];
+        jobs[n] = NULL;
+        found[n] = 0;
+        if (request_expired() || !health_admit(i))
+        {
+            continue;
+        }
+        jobs[n] = job_new(JOB_LSTAT, i, path);
+        if (jobs[n] == NULL)
+        {
+            continue;
+        }
+        jobs[n]->deadline = deadline;
+        if (job_submit_group(jobs[n], &group) != 0)
+        {
+            count(COUNTER(failovers));
+            job_put(jobs[n]);
+            jobs[n] = NULL;
+            continue;
+        }
+        if (preferred == -1)
+        {
+            preferred = n;
+        }
+        pending++;
+    }
+
+    while (pending > 0)
+    {
+        int n = job_wait_any(&group, jobs, Fscount, &deadline);
+        if (n == -1)
+        {
+            for (int k = 0; k < Fscount; k++)
+            {
+                if (jobs[k] != NULL)
+                {
+                    LOG("consistent_getattr: Timeout on  %s\n", Fss[order[k]]);
+                    deadline_missed(COUNTER(metadata_deadline_misses));
+                    job_put(jobs[k]);
+                    jobs[k] = NULL;
+                }
+            }
+            break;
+        }
+        answered++;
+        if (jobs[n]->res == 0)
+        {
+            sts[n] = jobs[n]->st;
+            found[n] = 1;
+        }
+        else
+        {
+            errnum = jobs[n]->errnum;
+            if (errnum == ENOENT)
+            {
+                LOC_SET(missing, order[n]);
+                nmissing++;
+                if (n < holders)
+                {
+                    location_forget(path);
+                    holders = 0;
+                }
+            }
+        }
+        job_put(jobs[n]);
+        jobs[n] = NULL;
+        pending--;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (n == preferred && found[n] && (!S_ISREG(sts[n].st_mode) || copy_complete(&sts[n], &now)))
+        {
+            break;
+        }
+    }
+    for (int k = 0; k < Fscount; k++)
+    {
+        if (jobs[k] != NULL) // Still out after an early answer. Not the replica's fault
+        {
+            job_discard(jobs[k]);
+            jobs[k] = NULL;
+        }
+    }
+    job_group_destroy(&group);
+
+    int best = -1;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int n = 0; n < Fscount; n++)
+    {
+        if (found[n] && (best == -1 || copy_better(&sts[n], &sts[best], &now)))
+        {
+            best = n;
+        }
+    }
+    if (best == -1)
+    {
+        if (answered == Fscount && errnum == ENOENT)
+        {
+            attr_cache_store(path, NULL, ENOENT, -1);
+        }
+        return -errnum;
+    }
+
+    int chosen = -1;
+    int divergent = 0;
+    for (int n = 0; n < Fscount; n++)
+    {
+        if (!found[n])
+        {
+            continue;
+        }
+        if (!same_copy(&sts[n], &sts[best], &now))
+        {
+            divergent = 1;
+        }
+        else if (chosen == -1)
+        {
+            chosen = n;
+        }
+    }
+    if (divergent)
+    {
+        count(COUNTER(divergent_files));
+    }
+    *st_data = sts[chosen];
+    *fsno = order[chosen];
+    attr_cache_store(path, st_data, 0, *fsno);
+    if (nmissing > 0)
+    {
+        location_store(path, *fsno, missing);
+    }
+    return 0;
+}
+
+// The replica whose copy of path open should pin, with its attributes in st, or -1 to use the
+// usual order (the path is missing, or no replica answered)
+static int consistent_replica(const char *path, struct stat *st)
+{
+    int errnum;
+    int fsno = -1;
+
+    if (attr_cache_lookup(path, st, &errnum, &fsno))
+    {
+        if (errnum != 0 || fsno != -1)
+        {
+            return errnum == 0 ? fsno : -1;
+        }
+    }
+    if (consistent_getattr(path, st, &fsno) != 0)
+    {
+        return -1;
+    }
+    return fsno;
+}
+
+/******************************
+ *
+ * Directory cache
+ *
+ * Listings keyed by path, kept per replica with the directory's mtime and ctime at the time it
+ * was read. A listing is revalidated with a single stat of the directory on that replica and
+ * only read again if it changed, or if it is older than dir_cache_max_age (for backends with
+ * coarse timestamps). Bounded by dir_cache_size, least recently used directories are evicted.
+ *
+ ******************************/
+
+typedef struct dir_replica
+{
+    GPtrArray *entries; // dir_entry items. NULL => nothing cached for this replica
+    struct timespec mtime;
+    struct timespec ctime;
+    long long read_at; // monotonic_ms()
+    size_t bytes;
+} dir_replica;
+
+typedef struct dir_cache_entry
+{
+    char *path; // Also the key in DirCache
+    size_t bytes;
+    GList lru;  // Link in DirLru, most recently used first
+    dir_replica replicas[]; // Fscount
+} dir_cache_entry;
+
+GHashTable *DirCache = NULL;
+static GQueue DirLru = G_QUEUE_INIT;
+static size_t DirCacheBytes = 0;
+static pthread_mutex_t DirLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dir_cache_entry_free(void *data)
+{
+    dir_cache_entry *entry = (dir_cache_entry *)data;
+    g_queue_unlink(&DirLru, &entry->lru);
+    DirCacheBytes -= entry->bytes;
+    for (int i = 0; i < Fscount; i++)
+    {
+        if (entry->replicas[i].entries != NULL)
+        {
+            g_ptr_array_unref(entry->replicas[i].entries);
+        }
+    }
+    free(entry->path);
+    free(entry);
+}
+
+// Copy what is cached for path into replicas[Fscount], with a reference on each entries array.
+// Returns 0 if nothing is cached
+static int dir_cache_lookup(const char *path, dir_replica *replicas)
+{
+    dir_cache_entry *entry;
+
+    memset(replicas, 0, Fscount * sizeof(dir_replica));
+    if (DirCache == NULL)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&DirLock);
+    entry = g_hash_table_lookup(DirCache, path);
+    if (entry != NULL)
+    {
+        for (int i = 0; i < Fscount; i++)
+        {
+            replicas[i] = entry->replicas[i];
+            if (replicas[i].entries != NULL)
+            {
+                g_ptr_array_ref(replicas[i].entries);
+            }
+        }
+        g_queue_unlink(&DirLru, &entry->lru);
+        g_queue_push_head_link(&DirLru, &entry->lru);
+    }
+    pthread_mutex_unlock(&DirLock);
+    return entry != NULL;
+}
+
+static void dir_replicas_release(dir_replica *replicas)
+{
+    for (int i = 0; i < Fscount; i++)
+    {
+        if (replicas[i].entries != NULL)
+        {
+            g_ptr_array_unref(replicas[i].entries);
+        }
+    }
+}
+
+// Remember the listing of path read on replica fsno, with the directory stat taken before reading.
+// entries NULL forgets what was cached for that replica
+static void dir_cache_store(const char *path, int fsno, GPtrArray *entries, const struct stat *st)
+{
+    dir_cache_entry *entry;
+    size_t bytes = 0;
+    size_t limit = (size_t)Conf.dir_cache_size * 1024 * 1024;
+
+    if (DirCache == NULL)
+    {
+        return;
+    }
+    if (entries != NULL)
+    {
+        for (guint i = 0; i < entries->len; i++)
+        {
+            dir_entry *de = g_ptr_array_index(entries, i);
+            bytes += sizeof(dir_entry) + strlen(de->name) + 1 + sizeof(gpointer) + (de->st != NULL ? sizeof(struct stat) : 0);
+        }
+        if (bytes > limit / 4) // Do not let one huge directory flush everything else
+        {
+            entries = NULL;
+            bytes = 0;
+        }
+    }
+
+    pthread_mutex_lock(&DirLock);
+    entry = g_hash_table_lookup(DirCache, path);
+    if (entry == NULL && entries == NULL)
+    {
+        pthread_mutex_unlock(&DirLock);
+        return;
+    }
+    if (entry == NULL)
+    {
+        entry = calloc(1, sizeof(dir_cache_entry) + Fscount * sizeof(dir_replica));
+        if (entry == NULL || (entry->path = strdup(path)) == NULL)
+        {
+            free(entry);
+            pthread_mutex_unlock(&DirLock);
+            return;
+        }
+        entry->lru.data = entry;
+        g_queue_push_head_link(&DirLru, &entry->lru);
+        g_hash_table_insert(DirCache, entry->path, entry);
+    }
+
+    dir_replica *replica = &entry->replicas[fsno];
+    if (replica->entries != NULL)
+    {
+        g_ptr_array_unref(replica->entries);
+    }
+    entry->bytes -= replica->bytes;
+    DirCacheBytes -= replica->bytes;
+    memset(replica, 0, sizeof(dir_replica));
+    if (entries != NULL)
+    {
+        replica->entries = g_ptr_array_ref(entries);
+        replica->mtime = st->st_mtim;
+        replica->ctime = st->st_ctim;
+        replica->read_at = monotonic_ms();
+        replica->bytes = bytes;
+        entry->bytes += bytes;
+        DirCacheBytes += bytes;
+    }
+
+    while (DirCacheBytes > limit)
+    {
+        dir_cache_entry *oldest = g_queue_peek_tail(&DirLru);
+        g_hash_table_remove(DirCache, oldest->path);
+    }
+    pthread_mutex_unlock(&DirLock);
+}
+
+// Can the listing cached for a replica be used if the directory stat st is unchanged?
+static int dir_replica_fresh(const dir_replica *replica)
+{
+    double max_age = Conf.dir_cache_max_age;
+
+    if (replica->entries == NULL)
+    {
+        return 0;
+    }
+    // With readdir_stat a listing also carries attributes, which are only good for as long as
+    // the attr cache would keep them. Reading it again is still one call, not one per entry
+    if (Conf.readdir_stat && Conf.attr_cache_ttl > 0 && (max_age <= 0 || Conf.attr_cache_ttl < max_age))
+    {
+        max_age = Conf.attr_cache_ttl;
+    }
+    return max_age <= 0 || monotonic_ms() - replica->read_at < max_age * 1000;
+}
+
+static int dir_replica_unchanged(const dir_replica *replica, const struct stat *st)
+{
+    return replica->mtime.tv_sec == st->st_mtim.tv_sec && replica->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           replica->ctime.tv_sec == st->st_ctim.tv_sec && replica->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static void start_dir_cache(void)
+{
+    if (Conf.dir_cache_size == 0)
+    {
+        return;
+    }
+    DirCache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, dir_cache_entry_free);
+}
+
+// Runs on the backend when a call its caller gave up on returns after all: keep what it learned.
+// A listing is cached for its replica, a stat if nobody answered for the path since. Files are
+// left to getattr with consistency, which compares all copies
+static void job_harvest(backend_job *job)
+{
+    const char *path = job->path != NULL ? job->path + Fslen[job->fsno] : NULL;
+    int cached = 0;
+
+    if (job->res == -1 || path == NULL)
+    {
+        return;
+    }
+    if (job->type == JOB_READDIR)
+    {
+        dir_cache_store(path, job->fsno, job->entries, &job->st);
+        cached = DirCache != NULL;
+    }
+    else if (job->type == JOB_LSTAT && !(Conf.consistency && S_ISREG(job->st.st_mode)))
+    {
+        cached = attr_cache_offer(path, &job->st);
+    }
+    if (cached)
+    {
+        count(COUNTER(late_cached));
+    }
+}
+
+/******************************
+ *
+ * Block cache
+ *
+ * Optional, on local disk under cache_dir. Files are cached in CACHE_BLOCK sized blocks, one
+ * file per block, keyed by a hash of the path and the size and mtime the backend had when the
+ * file was opened. A file that changes gets a new key, and its old blocks age out. Blocks are
+ * filled whole by the backend workers, and evicted with CLOCK once cache_size is exceeded.
+ * The index is rebuilt from cache_dir at startup, so the cache survives restarts.
+ *
+ ******************************/
+
+#define CACHE_BLOCK (1024 * 1024)
+#define CACHE_MAX_FILLS 16 // Blocks being filled at once
+
+typedef struct cache_block
+{
+    guint64 key;        // cache_key() of the file
+    unsigned int block; // offset / CACHE_BLOCK
+    unsigned int len;   // Bytes in the block file. 0 while it is filled
+    int referenced;     // CLOCK bit, set on every hit
+    guint clock_pos;    // Index in BlockClock
+} cache_block;
+
+static GHashTable *BlockCache = NULL; // cache_block => itself
+static GPtrArray *BlockClock;         // Filled blocks, swept by BlockHand
+static guint BlockHand = 0;
+static unsigned long long BlockCacheBytes = 0;
+static unsigned long long BlockCacheLimit = 0;
+static int BlockFills = 0;
+static pthread_mutex_t BlockLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t BlockFilled; // Broadcast when a fill completes or fails
+
+static guint cache_block_hash(gconstpointer data)
+{
+    const cache_block *b = data;
+    guint64 h = b->key ^ ((guint64)b->block * 0x9e3779b97f4a7c15ULL);
+    return (guint)(h ^ (h >> 32));
+}
+
+static gboolean cache_block_equal(gconstpointer a, gconstpointer b)
+{
+    const cache_block *x = a;
+    const cache_block *y = b;
+    return x->key == y->key && x->block == y->block;
+}
+
+// FNV-1a of the path, the size and the mtime. Never 0, which means not cached
+static guint64 cache_key(const char *path, const struct stat *st)
+{
+    guint64 h = 0xcbf29ce484222325ULL;
+    long long fields[3] = {(long long)st->st_size, (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec};
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)path; *p; p++)
+    {
+        h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    for (p = (const unsigned char *)fields; p < (const unsigned char *)(fields + 3); p++)
+    {
+        h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    return h == 0 ? 1 : h;
+}
+
+static void cache_block_file(char *name, size_t len, guint64 key, unsigned int block, const char *suffix)
+{
+    snprintf(name, len, "%s/%02x/%016llx.%u%s", Conf.cache_dir, (unsigned int)(key >> 56), (unsigned long long)key, block, suffix);
+}
+
+// Parse a size like 200G. Returns 0 if it is not one. A bare number is not, cache_size=200
+// is much more likely a forgotten unit than a 200 byte cache
+static unsigned long long parse_size(const char *s)
+{
+    char *end;
+    unsigned long long size = strtoull(s, &end, 10);
+
+    switch (*end)
+    {
+    case 'T': case 't':
+        size <<= 10; // Fall through
+    case 'G': case 'g':
+        size <<= 10; // Fall through
+    case 'M': case 'm':
+        size <<= 10; // Fall through
+    case 'K': case 'k':
+        size <<= 10;
+        end++;
+        break;
+    default:
+        return 0;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+static void block_clock_remove(cache_block *b)
+{
+    cache_block *last = g_ptr_array_index(BlockClock, BlockClock->len - 1);
+    g_ptr_array_index(BlockClock, b->clock_pos) = last;
+    last->clock_pos = b->clock_pos;
+    g_ptr_array_remove_index(BlockClock, BlockClock->len - 1);
+}
+
+// Evict until the cache fits. Call with BlockLock held. Evicted blocks are moved to evicted
+static void block_cache_evict(GPtrArray *evicted)
+{
+    while (BlockCacheBytes > BlockCacheLimit && BlockClock->len > 0)
+    {
+        if (BlockHand >= BlockClock->len)
+        {
+            BlockHand = 0;
+        }
+        cache_block *b = g_ptr_array_index(BlockClock, BlockHand);
+        if (b->referenced)
+        {
+            b->referenced = 0;
+            BlockHand++;
+            continue;
+        }
+        block_clock_remove(b);
+        g_hash_table_steal(BlockCache, b);
+        BlockCacheBytes -= b->len;
+        g_ptr_array_add(evicted, b);
+        count(COUNTER(block_cache_evictions));
+    }
+}
+
+static void block_cache_unlink(GPtrArray *evicted)
+{
+    char name[PATH_MAX];
+
+    for (guint i = 0; i < evicted->len; i++)
+    {
+        cache_block *b = g_ptr_array_index(evicted, i);
+        cache_block_file(name, sizeof(name), b->key, b->block, "");
+        unlink(name);
+        free(b);
+    }
+    g_ptr_array_free(evicted, TRUE);
+}
+
+// Make a filled block visible, or forget it if the fill failed (len 0)
+static void block_cache_filled(cache_block *b, unsigned int len)
+{
+    GPtrArray *evicted = g_ptr_array_new();
+
+    pthread_mutex_lock(&BlockLock);
+    BlockFills--;
+    if (len == 0)
+    {
+        g_hash_table_remove(BlockCache, b);
+    }
+    else
+    {
+        b->len = len;
+        b->clock_pos = BlockClock->len;
+        g_ptr_array_add(BlockClock, b);
+        BlockCacheBytes += len;
+        block_cache_evict(evicted);
+    }
+    pthread_cond_broadcast(&BlockFilled);
+    pthread_mutex_unlock(&BlockLock);
+    block_cache_unlink(evicted);
+}
+
+// Runs on a backend worker: read the whole block through its own fd, check the file is still
+// the one the key was made from, and write it to cache_dir
+static void block_cache_fill(backend_job *job)
+{
+    cache_block *b = job->cache_block;
+    char name[PATH_MAX], tmp[PATH_MAX];
+    struct stat st;
+    size_t got = 0;
+
+    job->res = -1;
+    job->fd = open(job->path, O_RDONLY);
+    if (job->fd == -1)
+    {
+        block_cache_filled(b, 0);
+        return;
+    }
+    job->owns_fd = 1;
+    while (got < job->size)
+    {
+        ssize_t n = pread(job->fd, job->buf + got, job->size - got, job->offset + got);
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+    if (got != job->size || fstat(job->fd, &st) == -1 || st.st_size != job->st.st_size ||
+        st.st_mtim.tv_sec != job->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != job->st.st_mtim.tv_nsec)
+    {
+        block_cache_filled(b, 0);
+        return;
+    }
+
+    cache_block_file(name, sizeof(name), b->key, b->block, "");
+    cache_block_file(tmp, sizeof(tmp), b->key, b->block, ".tmp");
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || write(fd, job->buf, got) != (ssize_t)got || close(fd) == -1 || rename(tmp, name) == -1)
+    {
+        LOG("block_cache_fill: Could not write %s: %s\n", tmp, strerror(errno));
+        if (fd != -1)
+        {
+            unlink(tmp);
+        }
+        block_cache_filled(b, 0);
+        return;
+    }
+    job->res = got;
+    count(COUNTER(block_cache_fills));
+    block_cache_filled(b, got);
+}
+
+// Start filling a block on backend fsno unless it is cached or being filled. Call with
+// BlockLock held
+static void block_cache_request(int fsno, const char *path, guint64 key, const struct stat *st, unsigned int block)
+{
+    cache_block probe = {.key = key, .block = block};
+    off_t offset = (off_t)block * CACHE_BLOCK;
+
+    if (offset >= st->st_size || BlockFills >= CACHE_MAX_FILLS || g_hash_table_contains(BlockCache, &probe))
+    {
+        return;
+    }
+    cache_block *b = calloc(1, sizeof(cache_block));
+    backend_job *job = job_new(JOB_CACHE_FILL, fsno, path);
+    if (b != NULL && job != NULL)
+    {
+        job->size = st->st_size - offset < CACHE_BLOCK ? st->st_size - offset : CACHE_BLOCK;
+        job->buf = malloc(job->size);
+    }
+    if (b == NULL || job == NULL || job->buf == NULL)
+    {
+        free(b);
+        if (job != NULL)
+        {
+            job->refs = 1;
+            job_unref(job);
+        }
+        return;
+    }
+    b->key = key;
+    b->block = block;
+    job->offset = offset;
+    job->st = *st;
+    job->cache_block = b;
+    g_hash_table_add(BlockCache, b);
+    BlockFills++;
+    if (job_submit(job) != 0)
+    {
+        job->refs--;
+        g_hash_table_remove(BlockCache, b);
+        BlockFills--;
+    }
+    job_unref(job); // Runs even though nobody waits for it
+}
+
+// Serve a read of the file with the given key and stat from the cache. Missing blocks are
+// filled from backend fsno, waiting up to read_timeout for them. The next block is filled
+// ahead. Returns the byte count, or -1 to read from the backends instead
+static int block_cache_read(int fsno, const char *path, guint64 key, const struct stat *st, char *buf, size_t size, off_t offset)
+{
+    char name[PATH_MAX];
+    struct timespec deadline;
+    off_t end = offset + (off_t)size < st->st_size ? offset + (off_t)size : st->st_size;
+    unsigned int first = offset / CACHE_BLOCK;
+    unsigned int last = end > offset ? (end - 1) / CACHE_BLOCK : first;
+    int ready = 0;
+
+    if (offset >= st->st_size)
+    {
+        return 0;
+    }
+
+    deadline_in(&deadline, Conf.read_timeout);
+    pthread_mutex_lock(&BlockLock);
+    for (unsigned int block = first; block <= last + 1; block++)
+    {
+        block_cache_request(fsno, path, key, st, block);
+    }
+    while (!ready)
+    {
+        ready = 1;
+        for (unsigned int block = first; block <= last && ready; block++)
+        {
+            cache_block probe = {.key = key, .block = block};
+            cache_block *b = g_hash_table_lookup(BlockCache, &probe);
+            if (b == NULL) // Fill failed or evicted already
+            {
+                ready = -1;
+            }
+            else if (b->len == 0)
+            {
+                ready = 0;
+            }
+        }
+        if (!ready && pthread_cond_timedwait(&BlockFilled, &BlockLock, &deadline) == ETIMEDOUT)
+        {
+            deadline_missed(COUNTER(read_deadline_misses));
+            ready = -1;
+        }
+    }
+    if (ready == 1)
+    {
+        for (unsigned int block = first; block <= last; block++)
+        {
+            cache_block probe = {.key = key, .block = block};
+            cache_block *b = g_hash_table_lookup(BlockCache, &probe);
+            b->referenced = 1;
+        }
+    }
+    pthread_mutex_unlock(&BlockLock);
+    if (ready != 1)
+    {
+        count(COUNTER(block_cache_misses));
+        return -1;
+    }
+
+    // Blocks may be evicted meanwhile. Then the file is gone and the read goes to the backends
+    size_t got = 0;
+    while (offset + (off_t)got < end)
+    {
+        off_t pos = offset + got;
+        unsigned int block = pos / CACHE_BLOCK;
+        size_t want = end - pos;
+        if ((off_t)(block + 1) * CACHE_BLOCK - pos < (off_t)want)
+        {
+            want = (off_t)(block + 1) * CACHE_BLOCK - pos;
+        }
+        cache_block_file(name, sizeof(name), key, block, "");
+        int fd = open(name, O_RDONLY);
+        if (fd == -1)
+        {
+            count(COUNTER(block_cache_misses));
+            return -1;
+        }
+        ssize_t n = pread(fd, buf + got, want, pos - (off_t)block * CACHE_BLOCK);
+        close(fd);
+        if (n != (ssize_t)want)
+        {
+            count(COUNTER(block_cache_misses));
+            return -1;
+        }
+        got += n;
+    }
+    count(COUNTER(block_cache_hits));
+    return got;
+}
+
+// Index what an earlier run left in cache_dir
+static void block_cache_scan(void)
+{
+    char dirname[PATH_MAX], name[PATH_MAX];
+
+    for (int i = 0; i < 256; i++)
+    {
+        snprintf(dirname, sizeof(dirname), "%s/%02x", Conf.cache_dir, i);
+        if (mkdir(dirname, 0700) == -1 && errno != EEXIST)
+        {
+            LOG("block cache: Could not create %s: %s\n", dirname, strerror(errno));
+            continue;
+        }
+        DIR *dp = opendir(dirname);
+        if (dp == NULL)
+        {
+            continue;
+        }
+        struct dirent *de;
+        while ((de = readdir(dp)) != NULL)
+        {
+            unsigned long long key;
+            unsigned int block;
+            int used = 0;
+            struct stat st;
+            if (de->d_name[0] == '.')
+            {
+                continue;
+            }
+            if (snprintf(name, sizeof(name), "%s/%s", dirname, de->d_name) >= (int)sizeof(name))
+            {
+                continue;
+            }
+            if (sscanf(de->d_name, "%16llx.%u%n", &key, &block, &used) != 2 || de->d_name[used] != '\0' ||
+                stat(name, &st) == -1 || st.st_size == 0 || st.st_size > CACHE_BLOCK)
+            {
+                unlink(name); // Partial fill or not ours
+                continue;
+            }
+            cache_block *b = calloc(1, sizeof(cache_block));
+            if (b == NULL)
+            {
+                break; // Not counted against cache_size. The next start finds them again
+            }
+            b->key = key;
+            b->block = block;
+            b->len = st.st_size;
+            b->clock_pos = BlockClock->len;
+            g_ptr_array_add(BlockClock, b);
+            g_hash_table_add(BlockCache, b);
+            BlockCacheBytes += b->len;
+        }
+        closedir(dp);
+    }
+}
+
+static void start_block_cache(void)
+{
+    if (Conf.cache_dir == NULL)
+    {
+        return;
+    }
+    BlockCacheLimit = Conf.cache_size == NULL ? 0 : parse_size(Conf.cache_size);
+    if (BlockCacheLimit == 0)
+    {
+        fprintf(stderr, "cache_dir needs a cache_size with a unit (K, M, G or T), like cache_size=200G\n");
+        exit(1);
+    }
+    pthread_cond_init(&BlockFilled, &Job_condattr);
+    BlockCache = g_hash_table_new_full(cache_block_hash, cache_block_equal, NULL, free);
+    BlockClock = g_ptr_array_new();
+    block_cache_scan();
+
+    GPtrArray *evicted = g_ptr_array_new();
+    block_cache_evict(evicted);
+    block_cache_unlink(evicted);
+    LOG("block cache: %s has %u blocks, %llu bytes\n", Conf.cache_dir, BlockClock->len, BlockCacheBytes);
+}
+
+/******************************
+ *
+ * Stats file
+ *
+ * /.haread/stats in the mount, Prometheus text format. Rendered when it is opened, so every
+ * open is one consistent snapshot. Not listed in the root directory.
+ *
+ ******************************/
+
+#define STATS_DIR "/.haread"
+#define STATS_FILE "/.haread/stats"
+
+static int is_stats_path(const char *path)
+{
+    return strncmp(path, STATS_DIR, sizeof(STATS_DIR) - 1) == 0 &&
+           (path[sizeof(STATS_DIR) - 1] == '\0' || path[sizeof(STATS_DIR) - 1] == '/');
+}
+
+// Sum of one histogram over all threads
+static void stats_sum(latency_histogram *sum, size_t offset)
+{
+    memset(sum, 0, sizeof(*sum));
+    for (thread_stats *stats = __atomic_load_n(&Stats, __ATOMIC_ACQUIRE); stats != NULL; stats = stats->next)
+    {
+        latency_histogram *hist = (latency_histogram *)((char *)stats + offset);
+        sum->count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+        sum->errors += __atomic_load_n(&hist->errors, __ATOMIC_RELAXED);
+        sum->sum_us += __atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED);
+        for (int b = 0; b < HIST_BUCKETS; b++)
+        {
+            sum->buckets[b] += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Upper bound of the bucket holding quantile q, in microseconds
+static unsigned long long hist_quantile(const latency_histogram *hist, double q)
+{
+    unsigned long seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += hist->buckets[b];
+        if (seen > 0 && seen >= q * hist->count)
+        {
+            return hist_bucket_upper(b);
+        }
+    }
+    return 0;
+}
+
+// A histogram family, one series per labels[i] with a count. Buckets are exported per power of
+// two, quantiles with the full precision as a family of their own
+static void stats_write_histograms(FILE *out, const char *name, char **labels, const latency_histogram *hists, int n)
+{
+    fprintf(out, "# TYPE %s_seconds histogram\n", name);
+    for (int i = 0; i < n; i++)
+    {
+        const latency_histogram *hist = &hists[i];
+        unsigned long cumulative = 0;
+        int b = 0;
+
+        if (labels[i] == NULL)
+        {
+            continue;
+        }
+        for (int msb = 0; msb <= HIST_MAX_MSB; msb++)
+        {
+            unsigned long long le = 1ULL << msb;
+            while (b < HIST_BUCKETS - 1 && hist_bucket_upper(b) <= le)
+            {
+                cumulative += hist->buckets[b++];
+            }
+            fprintf(out, "%s_seconds_bucket{%s,le=\"%g\"} %lu\n", name, labels[i], le / 1e6, cumulative);
+        }
+        fprintf(out, "%s_seconds_bucket{%s,le=\"+Inf\"} %lu\n", name, labels[i], hist->count);
+        fprintf(out, "%s_seconds_sum{%s} %.6f\n", name, labels[i], hist->sum_us / 1e6);
+        fprintf(out, "%s_seconds_count{%s} %lu\n", name, labels[i], hist->count);
+    }
+    fprintf(out, "# TYPE %s_errors_total counter\n", name);
+    for (int i = 0; i < n; i++)
+    {
+        if (labels[i] != NULL)
+        {
+            fprintf(out, "%s_errors_total{%s} %lu\n", name, labels[i], hists[i].errors);
+        }
+    }
+    fprintf(out, "# TYPE %s_quantile_seconds gauge\n", name);
+    for (int i = 0; i < n; i++)
+    {
+        if (labels[i] != NULL && hists[i].count > 0)
+        {
+            fprintf(out, "%s_quantile_seconds{%s,quantile=\"0.5\"} %g\n", name, labels[i], hist_quantile(&hists[i], 0.5) / 1e6);
+            fprintf(out, "%s_quantile_seconds{%s,quantile=\"0.99\"} %g\n", name, labels[i], hist_quantile(&hists[i], 0.99) / 1e6);
+        }
+    }
+}
+
+#define STATS_COUNTER(out, name) \
+    fprintf(out, "# TYPE haread_" #name "_total counter\nharead_" #name "_total %lu\n", counter_total(COUNTER(name)))
+
+static char *stats_render(size_t *len)
+{
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len);
+
+    if (out == NULL)
+    {
+        return NULL;
+    }
+
+    int nops = OPS;
+    int nbackend = Fscount * JOB_TYPES;
+    latency_histogram *hists = malloc((nops + nbackend) * sizeof(latency_histogram));
+    char **labels = calloc(nops + nbackend, sizeof(char *));
+    if (hists == NULL || labels == NULL)
+    {
+        free(hists);
+        free(labels);
+        fclose(out);
+        free(text);
+        return NULL;
+    }
+    for (int op = 0; op < nops; op++)
+    {
+        stats_sum(&hists[op], offsetof(thread_stats, ops) + op * sizeof(latency_histogram));
+        labels[op] = g_strdup_printf("op=\"%s\"", Op_names[op]);
+    }
+    for (int i = 0; i < nbackend; i++)
+    {
+        latency_histogram *hist = &hists[nops + i];
+        stats_sum(hist, offsetof(thread_stats, backend) + i * sizeof(latency_histogram));
+        if (hist->count > 0) // Leave out calls a backend never made
+        {
+            labels[nops + i] = g_strdup_printf("backend=\"%s\",op=\"%s\"", Fss[i / JOB_TYPES], Job_names[i % JOB_TYPES]);
+        }
+    }
+    stats_write_histograms(out, "haread_op_duration", labels, hists, nops);
+    stats_write_histograms(out, "haread_backend_duration", labels + nops, hists + nops, nbackend);
+    for (int i = 0; i < nops + nbackend; i++)
+    {
+        g_free(labels[i]);
+    }
+    free(labels);
+    free(hists);
+
+    fprintf(out, "# TYPE haread_backend_up gauge\n");
+    for (int i = 0; i < Fscount; i++)
+    {
+        fprintf(out, "haread_backend_up{backend=\"%s\"} %d\n", Fss[i], fs_state(i) == FS_OK);
+    }
+    fprintf(out, "# TYPE haread_backend_breaker_trips_total counter\n");
+    for (int i = 0; i < Fscount; i++)
+    {
+        fprintf(out, "haread_backend_breaker_trips_total{backend=\"%s\"} %lu\n", Fss[i], __atomic_load_n(&Health[i].trips, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# TYPE haread_backend_breaker_trials_total counter\n");
+    for (int i = 0; i < Fscount; i++)
+    {
+        fprintf(out, "haread_backend_breaker_trials_total{backend=\"%s\"} %lu\n", Fss[i], __atomic_load_n(&Health[i].trials, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# TYPE haread_backend_latency_ewma_seconds gauge\n");
+    for (int i = 0; i < Fscount; i++)
+    {
+        fprintf(out, "haread_backend_latency_ewma_seconds{backend=\"%s\"} %g\n", Fss[i],
+                __atomic_load_n(&Health[i].latency_ewma, __ATOMIC_RELAXED) / 1e6);
+    }
+    fprintf(out, "# TYPE haread_backend_stuck_calls gauge\n");
+    for (int i = 0; i < Fscount; i++)
+    {
+        fprintf(out, "haread_backend_stuck_calls{backend=\"%s\"} %d\n", Fss[i], __atomic_load_n(&Pools[i].stuck, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# TYPE haread_backend_stuck_oldest_seconds gauge\n");
+    for (int i = 0; i < Fscount; i++)
+    {
+        fprintf(out, "haread_backend_stuck_oldest_seconds{backend=\"%s\"} %g\n", Fss[i], stuck_oldest_us(i) / 1e6);
+    }
+    fprintf(out, "# TYPE haread_backend_inflight_calls gauge\n");
+    for (int i = 0; i < Fscount; i++)
+    {
+        fprintf(out, "haread_backend_inflight_calls{backend=\"%s\"} %d\n", Fss[i], __atomic_load_n(&Pools[i].inflight, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# TYPE haread_backend_queued_calls gauge\n");
+    for (int i = 0; i < Fscount; i++)
+    {
+        // Both move on, so this is only a snapshot. Never report a wrapped difference
+        size_t dequeued = __atomic_load_n(&Pools[i].dequeue_pos, __ATOMIC_RELAXED);
+        size_t enqueued = __atomic_load_n(&Pools[i].enqueue_pos, __ATOMIC_RELAXED);
+        fprintf(out, "haread_backend_queued_calls{backend=\"%s\"} %zu\n", Fss[i], enqueued > dequeued ? enqueued - dequeued : 0);
+    }
+    fprintf(out, "# TYPE haread_backend_busy_total counter\n");
+    for (int i = 0; i < Fscount; i++)
+    {
+        fprintf(out, "haread_backend_busy_total{backend=\"%s\"} %lu\n", Fss[i], __atomic_load_n(&Pools[i].busy, __ATOMIC_RELAXED));
+    }
+    if (Conf.threads > 0)
+    {
+        fprintf(out, "# TYPE haread_fuse_threads gauge\n");
+        fprintf(out, "haread_fuse_threads %u\n", Conf.threads);
+        fprintf(out, "# TYPE haread_fuse_busy_threads gauge\n");
+        fprintf(out, "haread_fuse_busy_threads %d\n", __atomic_load_n(&Fuse_busy, __ATOMIC_RELAXED));
+    }
+
+    STATS_COUNTER(out, failovers);
+    STATS_COUNTER(out, metadata_deadline_misses);
+    STATS_COUNTER(out, open_deadline_misses);
+    STATS_COUNTER(out, read_deadline_misses);
+    STATS_COUNTER(out, readdir_deadline_misses);
+    STATS_COUNTER(out, request_deadline_misses);
+    STATS_COUNTER(out, read_hedges);
+    STATS_COUNTER(out, read_hedge_primary);
+    STATS_COUNTER(out, read_hedge_secondary);
+    STATS_COUNTER(out, attr_cache_hits);
+    STATS_COUNTER(out, attr_cache_misses);
+    STATS_COUNTER(out, dir_cache_hits);
+    STATS_COUNTER(out, dir_cache_misses);
+    STATS_COUNTER(out, location_hits);
+    STATS_COUNTER(out, location_misses);
+    STATS_COUNTER(out, location_stale);
+    STATS_COUNTER(out, readdir_attrs);
+    STATS_COUNTER(out, uring_calls);
+    STATS_COUNTER(out, uring_cancels);
+    STATS_COUNTER(out, divergent_files);
+    STATS_COUNTER(out, divergent_reads);
+    STATS_COUNTER(out, late_calls);
+    STATS_COUNTER(out, late_cached);
+    STATS_COUNTER(out, zero_copy_reads);
+    STATS_COUNTER(out, copied_reads);
+    STATS_COUNTER(out, prefetch_issued);
+    STATS_COUNTER(out, prefetch_hits);
+    STATS_COUNTER(out, prefetch_waste);
+    STATS_COUNTER(out, block_cache_hits);
+    STATS_COUNTER(out, block_cache_misses);
+    STATS_COUNTER(out, block_cache_fills);
+    STATS_COUNTER(out, block_cache_evictions);
+    fprintf(out, "# TYPE haread_dir_cache_bytes gauge\nharead_dir_cache_bytes %zu\n", __atomic_load_n(&DirCacheBytes, __ATOMIC_RELAXED));
+    fprintf(out, "# TYPE haread_block_cache_bytes gauge\nharead_block_cache_bytes %llu\n", __atomic_load_n(&BlockCacheBytes, __ATOMIC_RELAXED));
+
+    if (fclose(out) != 0)
+    {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static int stats_getattr(const char *path, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_mtime = st->st_ctime = st->st_atime = time(NULL);
+    if (strcmp(path, STATS_DIR) == 0)
+    {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+    if (strcmp(path, STATS_FILE) == 0)
+    {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        return 0; // Size unknown until rendered, read with direct_io
+    }
+    return -ENOENT;
+}
+
+static int stats_readdir(const char *path, void *buf, fuse_fill_dir_t filler)
+{
+    if (strcmp(path, STATS_DIR) != 0)
+    {
+        return -ENOTDIR;
+    }
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    filler(buf, "stats", NULL, 0);
+    return 0;
+}
+
+/******************************
+ *
+ * Callbacks for FUSE
+ *
+ ******************************/
+
+
+// Run a metadata call of type on path for a FUSE callback, on the replicas in the usual order
+// with metadata_timeout each, like getattr. A replica that times out, is busy, fails with an I/O
+// error or lacks the path is skipped. flags, name and size go to the job, size bytes of buf are
+// allocated for the result. Returns the completed job, to be released with job_put(), or NULL
+// with the error in *errnum
+static backend_job *metadata_job(job_type type, const char *path, int flags, const char *name, size_t size,
+                                 int *errnum)
+{
+    int order[Fscount];
+
+    *errnum = ETIMEDOUT;
+    replica_order(order);
+    location_order(path, order);
+    for (int n = 0; n < Fscount && !request_expired(); n++)
+    {
+        int i = order[n];
+        if (!health_admit(i))
+        {
+            continue;
+        }
+
+        struct timespec deadline;
+        deadline_in(&deadline, Conf.metadata_timeout);
+        backend_job *job = job_new(type, i, path);
+        if (job == NULL)
+        {
+            *errnum = errno;
+            return NULL;
+        }
+        job->flags = flags;
+        job->size = size;
+        if ((size > 0 && (job->buf = malloc(size)) == NULL) || (name != NULL && (job->name = strdup(name)) == NULL))
+        {
+            job->refs = 1;
+            job_unref(job);
+            *errnum = ENOMEM;
+            return NULL;
+        }
+
+        int rc = job_run(job, &deadline);
+        if (rc != 0)
+        {
+            if (rc != EBUSY)
+            {
+                LOG("%s: Timeout on  %s\n", Job_names[type], Fss[i]);
+                deadline_missed(COUNTER(metadata_deadline_misses));
+            }
+            count(COUNTER(failovers));
+            job_put(job);
+            continue;
+        }
+        if (job->res == -1 && (job->errnum == ENOENT || backend_error(job->errnum)))
+        {
+            *errnum = job->errnum;
+            job_put(job);
+            continue;
+        }
+        return job;
+    }
+    return NULL;
+}
+
+static int callback_getattr(const char *path, struct stat *st_data)
+{
+    //DEBUG("CALLLBACK_GETATRR %s\n", "sd");
+
+    int res = -1;
+    int errnum = ENOENT;
+    int answered = 0;
+
+    if (is_stats_path(path))
+    {
+        return stats_getattr(path, st_data);
+    }
+    if (attr_cache_lookup(path, st_data, &errnum, NULL))
+    {
+        return -errnum;
+    }
+    request_begin();
+    if (Conf.consistency && Fscount > 1)
+    {
+        int fsno;
+        return consistent_getattr(path, st_data, &fsno);
+    }
+
+    int order[Fscount];
+    unsigned long missing[LocWords]; // Replicas that answered ENOENT
+    int nmissing = 0;
+    replica_order(order);
+    int holders = location_order(path, order);
+    memset(missing, 0, sizeof(missing));
+
+    int all_timed_out = 1;
+    for (int n = 0; n < Fscount && !request_expired(); n++)
+    {
+        int i = order[n];
+        if (!health_admit(i)) // File system blocks. Continue
+        {
+            continue;
+        }
+
+        struct timespec deadline;
+        deadline_in(&deadline, Conf.metadata_timeout);
+        backend_job *job = job_new(JOB_LSTAT, i, path);
+        if (job == NULL)
+        {
+            return -errno;
+        }
+
+        // Wait for the worker to complete with a timeout
+        int rc = job_run(job, &deadline);
+        if (rc != 0)
+        {
+            if (rc != EBUSY) // The call to lstat timed out. A busy one goes elsewhere quietly
+            {
+                LOG("callback_getattr: Timeout on  %s\n", Fss[i]);
+                deadline_missed(COUNTER(metadata_deadline_misses));
+            }
+            count(COUNTER(failovers));
+            job_put(job);
+            continue;
+        } 
+        
+        all_timed_out = 0;
+        answered++;
+        res = job->res;
+        errnum = job->errnum;
+        if (res == 0)
+        {
+            *st_data = job->st;
+        }
+        job_put(job);
+        if (res == 0)
+        {
+            attr_cache_store(path, st_data, 0, -1);
+            if (nmissing > 0)
+            {
+                location_store(path, i, missing);
+            }
+            return 0;
+        }
+        if (errnum == ENOENT)
+        {
+            LOC_SET(missing, i);
+            nmissing++;
+            if (n < holders)
+            {
+                location_forget(path);
+                holders = 0;
+            }
+        }
+    }
+
+    if  (all_timed_out ) {
+        return - ETIMEDOUT;
+    }
+    // Only remember a missing path if every replica said so
+    if (answered == Fscount && errnum == ENOENT)
+    {
+        attr_cache_store(path, NULL, ENOENT, -1);
+    }
+    if (res == -1)
+    {
+        return -errnum;
+    }
+    return 0;
+}
+
+static int callback_readlink(const char *path, char *buf, size_t size)
+{
+    DEBUG("CALLLBACK_READLINK %s\n", path);
+
+    int errnum;
+    request_begin();
+    backend_job *job = metadata_job(JOB_READLINK, path, 0, NULL, size - 1, &errnum);
+    if (job == NULL)
+    {
+        return -errnum;
+    }
+    int res = job->res;
+    if (res == -1)
+    {
+        res = -job->errnum;
+    }
+    else
+    {
+        memcpy(buf, job->buf, res);
+        buf[res] = '\0';
+        res = 0;
+    }
+    job_put(job);
+    return res;
+}
+
+// The struct to pass directory path to the thread
+typedef struct arg_struct_opendir
+{
+    char *path;
+    DIR *dp;
+    int res;
+    long latency_us;
+    int done;              // Set under *lock when the probe returns, *cond is broadcast
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+} arg_struct_opendir;
+
+
+// Pass the entries one replica read on to FUSE, skipping names already listed. Attributes
+// gathered with readdir_stat go to the attr cache if the listing was just read (fresh), so the
+// getattr of each entry that follows a long listing does not have to ask the replicas. Except
+// for files with consistency, whose copies getattr has to compare
+static int filldir(const char *path, GPtrArray *entries, int fresh, void *buf, fuse_fill_dir_t filler,
+                   GHashTable *filesMap)
+{
+    char entry_path[PATH_MAX];
+    const char *dir = strcmp(path, "/") == 0 ? "" : path;
+
+    for (guint i = 0; i < entries->len; i++)
+    {
+        dir_entry *de = g_ptr_array_index(entries, i);
+        struct stat st;
+        if (g_hash_table_contains(filesMap, de->name))
+        {
+            continue;
+        }
+        if (de->st != NULL)
+        {
+            st = *de->st;
+            if (fresh && !(Conf.consistency && S_ISREG(st.st_mode)) &&
+                snprintf(entry_path, sizeof(entry_path), "%s/%s", dir, de->name) < (int)sizeof(entry_path))
+            {
+                attr_cache_store(entry_path, &st, 0, -1);
+                count(COUNTER(readdir_attrs));
+            }
+        }
+        else
+        {
+            memset(&st, 0, sizeof(st));
+            st.st_ino = de->ino;
+            st.st_mode = de->type << 12;
+        }
+        if (filler(buf, de->name, &st, 0))
+            return 1;
+        g_hash_table_add(filesMap, de->name);
+    }
+    return 0;
+}
+
+// Keep the path for readdir, so FUSE does not have to look it up again (flag_nopath)
+static int callback_opendir(const char *path, struct fuse_file_info *fi)
+{
+    char *dirpath = strdup(path);
+    if (dirpath == NULL)
+    {
+        return -ENOMEM;
+    }
+    fi->fh = (uint64_t)(uintptr_t)dirpath;
+    return 0;
+}
+
+static int callback_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    (void)path;
+    free((char *)(uintptr_t)fi->fh);
+    fi->fh = 0;
+    return 0;
+}
+
+// Read the directory on all replicas at once. Entries are passed on as each replica answers,
+// so a slow one only delays its own contribution, and one that times out is left out.
+// A replica with a cached listing is only asked to stat the directory, and its cached entries
+// are used if that shows no change
+static int callback_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+
+    (void)offset;
+    if (fi != NULL && fi->fh != 0)
+    {
+        path = (const char *)(uintptr_t)fi->fh;
+    }
+    if (is_stats_path(path))
+    {
+        return stats_readdir(path, buf, filler);
+    }
+
+    backend_job *jobs[Fscount];
+    backend_job *done[Fscount];
+    dir_replica cached[Fscount];
+    GPtrArray *listed[Fscount]; // What each replica that answered has, for the location index
+    GPtrArray *nothing = g_ptr_array_new(); // Listed for replicas without the directory
+    int fresh = 0;              // Some replica's listing was read, not taken from the cache
+    int ndone = 0;
+    int pending = 0;
+    int ok = 0;
+    int err = 0;
+    int full = 0;
+    struct timespec deadline;
+    job_group group;
+
+    request_begin();
+    dir_cache_lookup(path, cached);
+    deadline_in(&deadline, Conf.readdir_timeout);
+    job_group_init(&group);
+    for (int i = 0; i < Fscount; i++)
+    {
+        jobs[i] = NULL;
+        listed[i] = NULL;
+        if (!health_admit(i))
+        {
+            continue;
+        }
+        // Revalidate with a stat if we have a listing for this replica, otherwise read it
+        backend_job *job = job_new(dir_replica_fresh(&cached[i]) ? JOB_LSTAT : JOB_READDIR, i, path);
+        if (job == NULL)
+        {
+            continue;
+        }
+        job->unlimited = 1;
+        if (job_submit_group(job, &group) != 0)
+        {
+            job_put(job);
+            continue;
+        }
+        jobs[i] = job;
+        pending++;
+    }
+
+    // Names point into the entries of the finished jobs and the cached listings, which are kept
+    // until we are done
+    GHashTable *filesMap = g_hash_table_new(g_str_hash, g_str_equal);
+
+    while (pending > 0)
+    {
+        int i = job_wait_any(&group, jobs, Fscount, &deadline);
+        if (i == -1)
+        {
+            break;
+        }
+        backend_job *job = jobs[i];
+        jobs[i] = NULL;
+        pending--;
+
+        if (job->type == JOB_LSTAT)
+        {
+            if (job->res == 0 && dir_replica_unchanged(&cached[i], &job->st))
+            {
+                count(COUNTER(dir_cache_hits));
+                job_put(job);
+                listed[i] = cached[i].entries;
+                ok = 1;
+                if (!full)
+                {
+                    full = filldir(path, cached[i].entries, 0, buf, filler, filesMap);
+                }
+                continue;
+            }
+            // Changed or gone. Read it again
+            job_put(job);
+            job = job_new(JOB_READDIR, i, path);
+            if (job != NULL && job_submit_group(job, &group) == 0)
+            {
+                jobs[i] = job;
+                pending++;
+            }
+            else if (job != NULL)
+            {
+                job_put(job);
+            }
+            continue;
+        }
+
+        done[ndone++] = job;
+        fresh = 1;
+        if (job->res == -1)
+        {
+            dir_cache_store(path, i, NULL, NULL);
+            if (job->errnum == ENOENT)
+            {
+                listed[i] = nothing;
+            }
+            // A missing directory on one replica is fine, anything else wins over ENOENT
+            if (err == 0 || err == ENOENT)
+            {
+                err = job->errnum;
+            }
+            continue;
+        }
+        count(COUNTER(dir_cache_misses));
+        dir_cache_store(path, i, job->entries, &job->st);
+        listed[i] = job->entries;
+        ok = 1;
+        if (!full)
+        {
+            full = filldir(path, job->entries, 1, buf, filler, filesMap);
+        }
+    }
+
+    if (pending > 0)
+    {
+        deadline_missed(COUNTER(readdir_deadline_misses));
+    }
+    for (int i = 0; i < Fscount; i++)
+    {
+        if (jobs[i] != NULL)
+        {
+            LOG("Call to readdir(%s) timed out\n", jobs[i]->path);
+            job_put(jobs[i]);
+        }
+    }
+    g_hash_table_destroy(filesMap);
+    if (fresh)
+    {
+        location_learn_listing(path, listed);
+    }
+    g_ptr_array_unref(nothing);
+    for (int i = 0; i < ndone; i++)
+    {
+        job_put(done[i]);
+    }
+    dir_replicas_release(cached);
+    job_group_destroy(&group);
+
+    if (ok)
+    {
+        return 0;
+    }
+    if (err != 0)
+    {
+        return -err;
+    }
+    return -ETIMEDOUT;
+}
+
+static int callback_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    (void)path;
+    (void)mode;
+    (void)rdev;
+    return -EROFS;
+}
+
+static int callback_mkdir(const char *path, mode_t mode)
+{
+    (void)path;
+    (void)mode;
+    return -EROFS;
+}
+
+static int callback_unlink(const char *path)
+{
+    (void)path;
+    return -EROFS;
+}
+
+static int callback_rmdir(const char *path)
+{
+    (void)path;
+    return -EROFS;
+}
+
+static int callback_symlink(const char *from, const char *to)
+{
+    (void)from;
+    (void)to;
+    return -EROFS;
+}
+
+static int callback_rename(const char *from, const char *to)
+{
+    (void)from;
+    (void)to;
+    return -EROFS;
+}
+
+static int callback_link(const char *from, const char *to)
+{
+    (void)from;
+    (void)to;
+    return -EROFS;
+}
+
+static int callback_chmod(const char *path, mode_t mode)
+{
+    (void)path;
+    (void)mode;
+    return -EROFS;
+}
+
+static int callback_chown(const char *path, uid_t uid, gid_t gid)
+{
+    (void)path;
+    (void)uid;
+    (void)gid;
+    return -EROFS;
+}
+
+static int callback_truncate(const char *path, off_t size)
+{
+    (void)path;
+    (void)size;
+    return -EROFS;
+}
+
+static int callback_utime(const char *path, struct utimbuf *buf)
+{
+    (void)path;
+    (void)buf;
+    return -EROFS;
+}
+
+#define READAHEAD_DEFAULT 8 // Chunks
+#define READAHEAD_MAX 32
+#define READAHEAD_INITIAL 2 // Window when a stream is first detected
+#define READAHEAD_TRIGGER 2 // Sequential reads in a row before prefetching starts
+
+// A chunk read ahead on the pinned fd
+typedef struct prefetch_slot
+{
+    off_t offset;
+    size_t size;
+    backend_job *job;
+} prefetch_slot;
+
+// Sequential access detection for one open file
+typedef struct readahead_state
+{
+    off_t next;  // Where the next read starts if the reader is sequential
+    int streak;  // Sequential reads in a row
+    int window;  // Chunks to keep in flight. Doubles on hits, halves on random access
+    off_t eof;   // Seen from a short read, -1 until then
+    int nslots;
+    prefetch_slot slots[READAHEAD_MAX]; // By offset
+} readahead_state;
+
+// Per open file state. Stored in finfo->fh from callback_open until callback_release.
+// Reads reuse the pinned replica's fd instead of doing open+pread+close per chunk
+typedef struct haread_file
+{
+    pthread_mutex_t lock;
+    int fsno; // Pinned replica (index into Fss)
+    backend_fd *fd; // Open fd on the pinned replica. Take a reference to use it outside lock
+    char *path; // For reopening on another replica. FUSE does not pass it (flag_nopath)
+    GPtrArray *retired; // With zero_copy: fds FUSE may still read from after a repin. Put on release
+    readahead_state ra; // Under lock as well
+    guint64 cache_key;  // Block cache key, 0 => not cached
+    struct stat cache_st; // As the file was when opened, with the block cache or consistency
+    char *stats;        // The stats file as rendered on open. No backend then (fd NULL)
+    size_t stats_len;
+} haread_file;
+
+static int stats_open(const char *path, struct fuse_file_info *finfo)
+{
+    if (strcmp(path, STATS_FILE) != 0)
+    {
+        return strcmp(path, STATS_DIR) == 0 ? -EISDIR : -ENOENT;
+    }
+    haread_file *hfile = calloc(1, sizeof(haread_file));
+    if (hfile == NULL)
+    {
+        return -ENOMEM;
+    }
+    hfile->stats = stats_render(&hfile->stats_len);
+    if (hfile->stats == NULL)
+    {
+        free(hfile);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&hfile->lock, NULL);
+    hfile->fsno = -1;
+    hfile->fd = NULL;
+    finfo->fh = (uint64_t)(uintptr_t)hfile;
+    finfo->direct_io = 1; // Its size is not known to getattr
+    return 0;
+}
+
+static int callback_open(const char *path, struct fuse_file_info *finfo)
+{
+
+    int flags = finfo->flags;
+
+    if ((flags & O_WRONLY) || (flags & O_RDWR) || (flags & O_CREAT) || (flags & O_EXCL) || (flags & O_TRUNC) || (flags & O_APPEND))
+    {
+        return -EROFS;
+    }
+    if (is_stats_path(path))
+    {
+        return stats_open(path, finfo);
+    }
+    
+    // Disabled due to to much spam ..
+    //DEBUG("CALLLBACK_OPEN %s\n", path);
+    request_begin();
+
+    int order[Fscount];
+    unsigned long missing[LocWords]; // Replicas that answered ENOENT
+    int nmissing = 0;
+    replica_order(order);
+    int holders = location_order(path, order);
+    memset(missing, 0, sizeof(missing));
+    if (Conf.consistency && Fscount > 1)
+    {
+        // Pin the copy getattr chose. The others are only tried if its replica fails
+        struct stat st;
+        int chosen = consistent_replica(path, &st);
+        for (int n = 0; n < Fscount && chosen != -1; n++)
+        {
+            if (order[n] == chosen)
+            {
+                memmove(order + 1, order, n * sizeof(int));
+                order[0] = chosen;
+                holders = 0;
+                break;
+            }
+        }
+    }
+
+    int all_timed_out = 1;
+    for (int n = 0; n < Fscount && !request_expired(); n++) // Try open .
+    {
+        int i = order[n];
+        if (!health_admit(i))
+        {
+            continue;
+        }
+        struct timespec deadline;
+        deadline_in(&deadline, Conf.open_timeout);
+        backend_job *job = job_new(JOB_OPEN, i, path);
+        if (job == NULL)
+        {
+            return -errno;
+        }
+        job->flags = flags;
+
+        int rc = job_run(job, &deadline);
+        if (rc != 0)
+        {
+            if (rc != EBUSY)
+            {
+                LOG("callback_open: open(%s) timed out. Trying next fs if any\n", job->path);
+                deadline_missed(COUNTER(open_deadline_misses));
+            }
+            count(COUNTER(failovers));
+            job_put(job);
+            continue;
+        }
+        all_timed_out = 0;
+
+        int res = job->res;
+        int errnum = job->errnum;
+        if (res != -1  ) {
+            haread_file *hfile = malloc(sizeof(haread_file));
+            char *hpath = strdup(path);
+            backend_fd *bfd = NULL;
+            if (hfile != NULL && hpath != NULL)
+            {
+                job->owns_fd = 0;
+                bfd = backend_fd_new(i, job->fd);
+            }
+            if (bfd == NULL)
+            {
+                free(hfile);
+                free(hpath);
+                job_put(job);
+                return -ENOMEM;
+            }
+            pthread_mutex_init(&hfile->lock, NULL);
+            hfile->fsno = i;
+            hfile->fd = bfd;
+            hfile->path = hpath;
+            hfile->retired = NULL;
+            memset(&hfile->ra, 0, sizeof(hfile->ra));
+            hfile->ra.window = READAHEAD_INITIAL;
+            hfile->ra.eof = -1;
+            hfile->cache_key = 0;
+            hfile->stats = NULL;
+            hfile->cache_st = job->st;
+            if (BlockCache != NULL && job->st.st_size > 0)
+            {
+                hfile->cache_key = cache_key(path, &job->st);
+            }
+            job_put(job);
+            finfo->fh = (uint64_t)(uintptr_t)hfile;
+            if (nmissing > 0)
+            {
+                location_store(path, i, missing);
+            }
+            return 0;
+        }
+        job_put(job);
+        if ( res == -1 && errnum == ENOENT) {
+            LOC_SET(missing, i);
+            nmissing++;
+            if (n < holders)
+            {
+                location_forget(path);
+                holders = 0;
+            }
+            continue; // Try next fs
+        } else if ( res == -1 && errnum != ENOENT) {
+            return - errnum;
+        }    
+    }
+
+    if (all_timed_out) {
+        return -ETIMEDOUT;
+    }
+    return -ENOENT;
+}
+
+// Job reading a chunk on backend fsno, from fd if it is not NULL, otherwise by opening path
+static backend_job *read_job_new(int fsno, backend_fd *fd, const char *path, size_t size, off_t offset)
+{
+    backend_job *job = job_new(JOB_READ, fsno, path);
+    if (job == NULL)
+    {
+        return NULL;
+    }
+    job->buf = malloc(size);
+    if (job->buf == NULL)
+    {
+        job->refs = 1;
+        job_unref(job);
+        return NULL;
+    }
+    job->fd = fd != NULL ? fd->fd : -1;
+    job->shared = backend_fd_get(fd);
+    job->flags = O_RDONLY;
+    job->size = size;
+    job->offset = offset;
+    return job;
+}
+
+// Read a chunk on backend fsno, from fd if it is not NULL, otherwise by opening path.
+// Returns 0 when the call completed and the job must be released with job_put()
+static int timed_read(int fsno, backend_fd *fd, const char *path, size_t size, off_t offset, backend_job **jobp)
+{
+    struct timespec deadline;
+    backend_job *job;
+
+    deadline_in(&deadline, Conf.read_timeout);
+    job = read_job_new(fsno, fd, path, size, offset);
+    if (job == NULL)
+    {
+        return ENOMEM;
+    }
+
+    *jobp = job;
+    int rc = job_run(job, &deadline);
+    if (rc == ETIMEDOUT)
+    {
+        deadline_missed(COUNTER(read_deadline_misses));
+    }
+    return rc;
+}
+
+// Hint the backend about the access pattern on fd, without waiting for it
+static void fadvise_backend_fd(backend_fd *fd, int advice)
+{
+    backend_job *job = fd != NULL ? job_new(JOB_FADVISE, fd->fsno, NULL) : NULL;
+    if (job == NULL)
+    {
+        return;
+    }
+    job->fd = fd->fd;
+    job->shared = backend_fd_get(fd);
+    job->flags = advice;
+    if (job_submit(job) != 0)
+    {
+        job->refs--;
+    }
+    job_unref(job); // Runs even though nobody waits for it
+}
+
+// Drop prefetched chunks [from, nslots). Call with hfile->lock held
+static void readahead_drop(readahead_state *ra, int from)
+{
+    for (int i = from; i < ra->nslots; i++)
+    {
+        job_discard(ra->slots[i].job);
+        count(COUNTER(prefetch_waste));
+    }
+    if (from < ra->nslots)
+    {
+        ra->nslots = from;
+    }
+}
+
+// Keep window chunks of size in flight after the reader's position. Call with hfile->lock held
+static void readahead_fill(haread_file *hfile, size_t size)
+{
+    readahead_state *ra = &hfile->ra;
+    off_t offset = ra->nslots > 0 ? ra->slots[ra->nslots - 1].offset + (off_t)ra->slots[ra->nslots - 1].size : ra->next;
+
+    if (hfile->fd == NULL || fs_state(hfile->fsno) != FS_OK)
+    {
+        return;
+    }
+    while (ra->nslots < ra->window && (ra->eof == -1 || offset < ra->eof))
+    {
+        // Prefetch takes at most half of max_inflight, the rest is for reads somebody waits for
+        if (Conf.max_inflight > 0 &&
+            __atomic_load_n(&Pools[hfile->fsno].inflight, __ATOMIC_RELAXED) >= (int)Conf.max_inflight / 2)
+        {
+            return;
+        }
+        backend_job *job = read_job_new(hfile->fsno, hfile->fd, NULL, size, offset);
+        if (job == NULL)
+        {
+            return;
+        }
+        job->prefetch = 1;
+        if (job_submit(job) != 0) // Backend busy or stuck. Leave the room for real reads
+        {
+            job->refs--;
+            job_put(job);
+            return;
+        }
+        ra->slots[ra->nslots].offset = offset;
+        ra->slots[ra->nslots].size = size;
+        ra->slots[ra->nslots].job = job;
+        ra->nslots++;
+        count(COUNTER(prefetch_issued));
+        offset += size;
+    }
+}
+
+#define READAHEAD_MISS 0
+#define READAHEAD_HIT 1
+#define READAHEAD_TIMEOUT 2
+
+// Track the access pattern of an open file, serve the read from a prefetched chunk if there is
+// one, and keep the prefetch window full while the reader is sequential
+static int readahead_read(haread_file *hfile, int pinned, char *buf, size_t size, off_t offset, int *res)
+{
+    readahead_state *ra = &hfile->ra;
+    backend_job *job = NULL;
+    int advise = 0;
+
+    pthread_mutex_lock(&hfile->lock);
+    if (hfile->fsno != pinned) // Moved to another replica meanwhile
+    {
+        pthread_mutex_unlock(&hfile->lock);
+        return READAHEAD_MISS;
+    }
+    int hit = -1;
+    for (int i = 0; i < ra->nslots; i++)
+    {
+        if (ra->slots[i].offset == offset && ra->slots[i].size >= size)
+        {
+            hit = i;
+            break;
+        }
+    }
+    if (hit != -1)
+    {
+        job = ra->slots[hit].job;
+        ra->nslots--;
+        memmove(&ra->slots[hit], &ra->slots[hit + 1], (ra->nslots - hit) * sizeof(prefetch_slot));
+        ra->window = ra->window * 2 > (int)Conf.readahead ? (int)Conf.readahead : ra->window * 2;
+    }
+    if (hit != -1 || offset == ra->next)
+    {
+        ra->streak++;
+        advise = ra->streak == READAHEAD_TRIGGER;
+        // Chunks far behind the reader are not going to be asked for. Async reads may arrive a
+        // little out of order, so keep the ones just behind
+        int keep = 0;
+        while (keep < ra->nslots && ra->slots[keep].offset + (off_t)(ra->window * size) < offset)
+        {
+            keep++;
+        }
+        if (keep > 0)
+        {
+            for (int i = 0; i < keep; i++)
+            {
+                job_discard(ra->slots[i].job);
+                count(COUNTER(prefetch_waste));
+            }
+            ra->nslots -= keep;
+            memmove(&ra->slots[0], &ra->slots[keep], ra->nslots * sizeof(prefetch_slot));
+        }
+    }
+    else
+    {
+        // Random access. Stop prefetching until the reader is sequential again
+        readahead_drop(ra, 0);
+        ra->streak = 0;
+        ra->window = ra->window > 1 ? ra->window / 2 : 1;
+    }
+    if (offset + (off_t)size > ra->next)
+    {
+        ra->next = offset + size;
+    }
+    if (ra->streak >= READAHEAD_TRIGGER)
+    {
+        readahead_fill(hfile, size);
+    }
+    if (advise)
+    {
+        fadvise_backend_fd(hfile->fd, POSIX_FADV_SEQUENTIAL);
+    }
+    pthread_mutex_unlock(&hfile->lock);
+
+    if (job == NULL)
+    {
+        return READAHEAD_MISS;
+    }
+
+    struct timespec deadline;
+    deadline_in(&deadline, Conf.read_timeout);
+    if (job_wait(job, &deadline) != 0)
+    {
+        deadline_missed(COUNTER(read_deadline_misses));
+        job_put(job);
+        return READAHEAD_TIMEOUT;
+    }
+    if (job->res == -1) // Read it again the normal way
+    {
+        job_put(job);
+        return READAHEAD_MISS;
+    }
+    *res = job->res < (ssize_t)size ? job->res : (ssize_t)size;
+    memcpy(buf, job->buf, *res);
+    if (job->res < (ssize_t)job->size)
+    {
+        pthread_mutex_lock(&hfile->lock);
+        ra->eof = offset + job->res;
+        pthread_mutex_unlock(&hfile->lock);
+    }
+    job_put(job);
+    count(COUNTER(prefetch_hits));
+    return READAHEAD_HIT;
+}
+
+// With consistency, whether a read job that opened the file on another replica read the same
+// copy as the one hfile is pinned to, so a file is never stitched together from two copies
+static int copy_matches(haread_file *hfile, int pinned, backend_job *job)
+{
+    struct timespec now;
+
+    if (!Conf.consistency || hfile == NULL)
+    {
+        return 1;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (hfile->cache_st.st_size != -1 && job->st.st_size != -1 && same_copy(&hfile->cache_st, &job->st, &now))
+    {
+        return 1;
+    }
+    LOG("callback_read: Not reading %s from %s, its copy differs from the one on %s\n", hfile->path, Fss[job->fsno], Fss[pinned]);
+    count(COUNTER(divergent_reads));
+    return 0;
+}
+
+// Move an open file from replica pinned to replica fsno, taking over the fd the read job opened
+static void pin_file(haread_file *hfile, int pinned, int fsno, backend_job *job)
+{
+    backend_fd *old = NULL;
+
+    if (hfile == NULL || job->fd == -1 || !job->owns_fd)
+    {
+        return;
+    }
+    job->owns_fd = 0;
+    backend_fd *bfd = backend_fd_new(fsno, job->fd);
+    if (bfd == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&hfile->lock);
+    if (hfile->fsno == pinned) // Another thread may already have moved it
+    {
+        old = hfile->fd;
+        count(COUNTER(failovers));
+        readahead_drop(&hfile->ra, 0); // Read from the old fd
+        hfile->fsno = fsno;
+        hfile->fd = bfd;
+        bfd = NULL;
+        if (Conf.zero_copy && old != NULL)
+        {
+            // A read_buf reply may still be splicing from it, without a reference
+            if (hfile->retired == NULL)
+            {
+                hfile->retired = g_ptr_array_new();
+            }
+            g_ptr_array_add(hfile->retired, old);
+            old = NULL;
+        }
+    }
+    pthread_mutex_unlock(&hfile->lock);
+    backend_fd_put(old); // Closed once the reads still using it are done
+    backend_fd_put(bfd);
+}
+
+// Read from the pinned fd, and if it has not answered within the hedge delay, send the same read
+// to the next healthy replica. The first successful answer wins and the other job is discarded.
+// Returns 1 with the byte count in *res when the read was served, 0 to fall back to failover
+static int hedged_read(haread_file *hfile, int pinned, backend_fd *fd, const char *path, char *buf, size_t size, off_t offset, int *res)
+{
+    backend_job *jobs[2] = {NULL, NULL};
+    int fsnos[2] = {pinned, -1};
+    struct timespec deadline, hedge_deadline;
+    job_group group;
+    int served = 0;
+    int hedged = 0;
+
+    deadline_in(&deadline, Conf.read_timeout);
+    clock_gettime(CLOCK_MONOTONIC, &hedge_deadline);
+    long us = hedge_delay_us(pinned) + hedge_deadline.tv_nsec / 1000;
+    hedge_deadline.tv_sec += us / 1000000;
+    hedge_deadline.tv_nsec = (us % 1000000) * 1000;
+    if (hedge_deadline.tv_sec > deadline.tv_sec ||
+        (hedge_deadline.tv_sec == deadline.tv_sec && hedge_deadline.tv_nsec > deadline.tv_nsec))
+    {
+        hedge_deadline = deadline;
+    }
+
+    jobs[0] = read_job_new(pinned, fd, NULL, size, offset);
+    if (jobs[0] == NULL)
+    {
+        *res = -ENOMEM;
+        return 1;
+    }
+    job_group_init(&group);
+    if (job_submit_group(jobs[0], &group) != 0)
+    {
+        job_put(jobs[0]);
+        job_group_destroy(&group);
+        return 0;
+    }
+
+    int winner = job_wait_any(&group, jobs, 1, &hedge_deadline);
+    if (winner == -1)
+    {
+        // Pinned replica is slow. Race the best other healthy one, not from a lower tier
+        int order[Fscount];
+        replica_order(order);
+        for (int n = 0; n < Fscount; n++)
+        {
+            int i = order[n];
+            if (i == pinned || Fsprio[i] > Fsprio[pinned] || !health_admit(i))
+            {
+                continue;
+            }
+            jobs[1] = read_job_new(i, NULL, path, size, offset);
+            if (jobs[1] != NULL && job_submit_group(jobs[1], &group) != 0)
+            {
+                job_put(jobs[1]);
+                jobs[1] = NULL;
+            }
+            if (jobs[1] != NULL)
+            {
+                fsnos[1] = i;
+                hedged = 1;
+                count(COUNTER(read_hedges));
+                break;
+            }
+        }
+    }
+
+    // First successful answer wins. A failed one leaves the race to the other
+    while (!served && (jobs[0] != NULL || jobs[1] != NULL))
+    {
+        if (winner == -1)
+        {
+            winner = job_wait_any(&group, jobs, 2, &deadline);
+        }
+        if (winner == -1)
+        {
+            LOG("callback_read: read(%s) timed out on %s. Reopening on next fs if any\n", path, Fss[pinned]);
+            deadline_missed(COUNTER(read_deadline_misses));
+            break;
+        }
+        backend_job *job = jobs[winner];
+        // A read of a copy other than the pinned one loses like a failed one
+        int same = job->res == -1 || winner == 0 || copy_matches(hfile, pinned, job);
+        if (job->res != -1 && same)
+        {
+            *res = job->res;
+            memcpy(buf, job->buf, job->res);
+            if (hedged)
+            {
+                count(winner == 0 ? COUNTER(read_hedge_primary) : COUNTER(read_hedge_secondary));
+            }
+            if (winner == 1)
+            {
+                pin_file(hfile, pinned, fsnos[1], job);
+            }
+            served = 1;
+        }
+        else if (same)
+        {
+            LOG("callback_read: read(%s) failed on %s: %s\n", path, Fss[fsnos[winner]], strerror(job->errnum));
+        }
+        job_put(job);
+        jobs[winner] = NULL;
+        winner = -1;
+    }
+
+    for (int k = 0; k < 2; k++)
+    {
+        if (jobs[k] != NULL)
+        {
+            if (served)
+            {
+                job_discard(jobs[k]); // The loser
+            }
+            else
+            {
+                job_put(jobs[k]);
+            }
+        }
+    }
+    job_group_destroy(&group);
+    return served;
+}
+
+static int callback_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *finfo)
+{
+    haread_file *hfile = (haread_file *)(uintptr_t)finfo->fh;
+    backend_job *job = NULL;
+    int pinned = -1;
+    int errnum = ENOENT;
+
+    if (hfile != NULL)
+    {
+        path = hfile->path;
+    }
+    request_begin();
+
+    if (hfile != NULL && hfile->stats != NULL)
+    {
+        if (offset >= (off_t)hfile->stats_len)
+        {
+            return 0;
+        }
+        size_t n = hfile->stats_len - offset < size ? hfile->stats_len - offset : size;
+        memcpy(buf, hfile->stats + offset, n);
+        return n;
+    }
+
+    if (hfile != NULL && hfile->cache_key != 0)
+    {
+        pthread_mutex_lock(&hfile->lock);
+        int fsno = hfile->fsno;
+        pthread_mutex_unlock(&hfile->lock);
+        // Only where missing blocks would be filled from. Not health_admit(), which would use up
+        // the breaker's trial even when every block is cached
+        if (fs_blocks(fsno))
+        {
+            fsno = preferred_replica();
+        }
+        int res = block_cache_read(fsno, path, hfile->cache_key, &hfile->cache_st, buf, size, offset);
+        if (res >= 0)
+        {
+            return res;
+        }
+    }
+
+    // Fast path: pread on the fd pinned by callback_open. The reference keeps a failover on
+    // another thread from closing it under us
+    if (hfile != NULL)
+    {
+        pthread_mutex_lock(&hfile->lock);
+        pinned = hfile->fsno;
+        backend_fd *fd = backend_fd_get(hfile->fd);
+        pthread_mutex_unlock(&hfile->lock);
+
+        int prefetched = READAHEAD_MISS;
+        int served = 0;
+        int res;
+        int usable = fd != NULL && health_admit(pinned);
+        if (usable && Conf.readahead > 0)
+        {
+            prefetched = readahead_read(hfile, pinned, buf, size, offset, &res);
+            served = prefetched == READAHEAD_HIT;
+            if (prefetched == READAHEAD_TIMEOUT)
+            {
+                LOG("callback_read: prefetched read(%s) timed out on %s. Reopening on next fs if any\n", path, Fss[pinned]);
+            }
+        }
+
+        if (!served && usable && prefetched != READAHEAD_TIMEOUT)
+        {
+            if (Conf.hedge && Fscount > 1)
+            {
+                served = hedged_read(hfile, pinned, fd, path, buf, size, offset, &res);
+            }
+            else
+            {
+                int rc = timed_read(pinned, fd, NULL, size, offset, &job);
+                if (rc == ENOMEM)
+                {
+                    res = -ENOMEM;
+                    served = 1;
+                }
+                else if (rc != 0)
+                {
+                    if (rc != EBUSY)
+                    {
+                        LOG("callback_read: read(%s) timed out on %s. Reopening on next fs if any\n", path, Fss[pinned]);
+                    }
+                }
+                else if (job->res != -1)
+                {
+                    res = job->res;
+                    memcpy(buf, job->buf, res);
+                    served = 1;
+                }
+                else
+                {
+                    LOG("callback_read: read(%s) failed on %s: %s. Reopening on next fs if any\n", path, Fss[pinned], strerror(job->errnum));
+                }
+                if (rc != ENOMEM)
+                {
+                    job_put(job);
+                }
+            }
+        }
+        backend_fd_put(fd);
+        if (served)
+        {
+            return res;
+        }
+    }
+
+    // The pinned replica failed or timed out. Reopen on the others
+    int order[Fscount];
+    replica_order(order);
+    int holders = location_order(path, order);
+    for (int n = 0; n < Fscount; n++) 
+    {
+        int i = order[n];
+        if (request_expired())
+        {
+            return -ETIMEDOUT;
+        }
+        if (i == pinned)
+        {
+            continue;
+        }
+        if (!health_admit(i))
+        {
+            continue;
+        }
+
+        // Disabled due to to much spam ..
+        //DEBUG("CALLLBACK_READ %s\n", path);
+
+        int rc = timed_read(i, NULL, path, size, offset, &job);
+        if (rc == ENOMEM)
+        {
+            return -ENOMEM;
+        }
+        if (rc != 0) 
+        {
+            if (rc != EBUSY)
+            {
+                LOG("callback_read: read(%s) timed out. Trying next fs if any\n", job->path);
+            }
+            job_put(job);
+            continue;
         }
-        free(ipath);
         
-        if (args.res != -1  ) {
-            return args.res;
+        int res = job->res;
+        errnum = job->errnum;
+        if (res != -1 && !copy_matches(hfile, pinned, job))
+        {
+            job_put(job);
+            errnum = EIO; // Unless another replica has the same copy
+            continue;
+        }
+        if (res != -1  ) {
+            memcpy(buf, job->buf, res);
+            pin_file(hfile, pinned, i, job);
+            job_put(job);
+            return res;
         }
-        if ( args.res == -1 && args.errnum == ENOENT) { // Try next fs
+        job_put(job);
+        if ( errnum == ENOENT) { // Try next fs
+            if (n < holders)
+            {
+                location_forget(path);
+                holders = 0;
+            }
             continue; 
-        } else if ( args.res == -1 && args.errnum != ENOENT) {
-            return args.res;
+        } else {
+            return -errnum;
         }
     }
-    
-    return args.res;
-    
+    
+    return -errnum;
+    
+}
+
+// Zero copy read. When the pinned replica is healthy the reply is just its fd and offset, and
+// libfuse splices the data from the backend's page cache to /dev/fuse (or reads it into its own
+// buffer when splice is not available). That read runs on the FUSE thread without our timeout
+// and failover, so it is only used on a replica the monitor sees as up, and not with hedging.
+// Nor for files in the block cache, or with consistency, which checks the copy it reads from.
+// Everything else goes through callback_read into a buffer
+static int callback_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *finfo)
+{
+    haread_file *hfile = (haread_file *)(uintptr_t)finfo->fh;
+    struct fuse_bufvec *bufv = malloc(sizeof(*bufv));
+
+    if (bufv == NULL)
+    {
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(size);
+
+    if (hfile != NULL && hfile->cache_key == 0 && !Conf.hedge && !Conf.consistency)
+    {
+        pthread_mutex_lock(&hfile->lock);
+        int pinned = hfile->fsno;
+        int fd = hfile->fd != NULL ? hfile->fd->fd : -1; // Kept open until release, see pin_file
+        pthread_mutex_unlock(&hfile->lock);
+
+        if (fd != -1 && fs_state(pinned) == FS_OK)
+        {
+            bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            bufv->buf[0].fd = fd;
+            bufv->buf[0].pos = offset;
+            count(COUNTER(zero_copy_reads));
+            *bufp = bufv;
+            return 0;
+        }
+    }
+
+    count(COUNTER(copied_reads));
+    bufv->buf[0].mem = malloc(size);
+    if (bufv->buf[0].mem == NULL)
+    {
+        free(bufv);
+        return -ENOMEM;
+    }
+    int res = callback_read(path, bufv->buf[0].mem, size, offset, finfo);
+    if (res < 0)
+    {
+        free(bufv->buf[0].mem);
+        free(bufv);
+        return res;
+    }
+    bufv->buf[0].size = res;
+    *bufp = bufv;
+    return 0;
 }
 
 static int callback_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *finfo)
@@ -662,26 +5481,78 @@ static int callback_write(const char *path, const char *buf, size_t size, off_t
 static int callback_statfs(const char *path, struct statvfs *st_buf)
 {
     DEBUG("CALLLBACK_STATFS %s", "sd");
-    int res;
-    char *ipath;
-    ipath = translate_path(path);
-
-    res = statvfs(path, st_buf);
-    free(ipath);
-    if (res == -1)
+    int errnum;
+    request_begin();
+    backend_job *job = metadata_job(JOB_STATFS, path, 0, NULL, sizeof(struct statvfs), &errnum);
+    if (job == NULL)
     {
-        return -errno;
+        return -errnum;
     }
-    return 0;
+    int res = job->res == -1 ? -job->errnum : 0;
+    if (res == 0)
+    {
+        memcpy(st_buf, job->buf, sizeof(struct statvfs));
+    }
+    job_put(job);
+    return res;
 }
 
 static int callback_release(const char *path, struct fuse_file_info *finfo)
 {
     (void)path;
-    (void)finfo;
+    haread_file *hfile = (haread_file *)(uintptr_t)finfo->fh;
+
+    if (hfile == NULL)
+    {
+        return 0;
+    }
+    readahead_drop(&hfile->ra, 0); // Their jobs close the fd when they are done with it
+    backend_fd_put(hfile->fd);
+    if (hfile->retired != NULL)
+    {
+        for (guint i = 0; i < hfile->retired->len; i++)
+        {
+            backend_fd_put(g_ptr_array_index(hfile->retired, i));
+        }
+        g_ptr_array_free(hfile->retired, TRUE);
+    }
+    free(hfile->path);
+    free(hfile->stats);
+    pthread_mutex_destroy(&hfile->lock);
+    free(hfile);
+    finfo->fh = 0;
     return 0;
 }
 
+// Kernel request queue, when not given as -o max_background/congestion_threshold
+#define MAX_BACKGROUND_PER_FS 8
+
+static void *callback_init(struct fuse_conn_info *conn)
+{
+    // The kernel default of 12 background requests (readahead, async reads) is low when every
+    // backend has its own workers. -o max_background and -o congestion_threshold still win
+    if (conn->max_background == 0)
+    {
+        conn->max_background = MAX_BACKGROUND_PER_FS * Fscount;
+    }
+    if (conn->congestion_threshold == 0)
+    {
+        conn->congestion_threshold = conn->max_background * 3 / 4;
+    }
+    if (Conf.zero_copy)
+    {
+        // Let libfuse splice read_buf replies straight from the backend fd
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    }
+    return NULL;
+}
+
+static void callback_destroy(void *private_data)
+{
+    (void)private_data;
+    stop_uring();
+}
+
 static int callback_fsync(const char *path, int crap, struct fuse_file_info *finfo)
 {
     (void)path;
@@ -695,19 +5566,25 @@ static int callback_access(const char *path, int mode)
 {
     
     int res;
-    char *ipath;
-    ipath = translate_path(path);
-    DEBUG("CALLLBACK_ACCESS %s\n", ipath);
+    int errnum;
     if (mode & W_OK)
     {
         return -EROFS;
     }
-    res = access(ipath, mode);
-    free(ipath);
-    if (res == -1)
+    if (is_stats_path(path))
     {
-        return -errno;
+        struct stat st;
+        return stats_getattr(path, &st);
+    }
+    DEBUG("CALLLBACK_ACCESS %s\n", path);
+    request_begin();
+    backend_job *job = metadata_job(JOB_ACCESS, path, mode, NULL, 0, &errnum);
+    if (job == NULL)
+    {
+        return -errnum;
     }
+    res = job->res == -1 ? -job->errnum : 0;
+    job_put(job);
     return res;
 }
 
@@ -730,16 +5607,25 @@ static int callback_setxattr(const char *path, const char *name, const char *val
 static int callback_getxattr(const char *path, const char *name, char *value, size_t size)
 {
     DEBUG("CALLLBACK_GETXATTR %s\n", path);
-    int res;
-    char *ipath;
+    int errnum;
 
-    ipath = translate_path(path);
-    res = lgetxattr(ipath, name, value, size);
-    free(ipath);
-    if (res == -1)
+    if (is_stats_path(path))
+    {
+        return -ENODATA;
+    }
+
+    request_begin();
+    backend_job *job = metadata_job(JOB_GETXATTR, path, 0, name, size, &errnum);
+    if (job == NULL)
+    {
+        return -errnum;
+    }
+    int res = job->res == -1 ? -job->errnum : (int)job->res;
+    if (res > 0 && size > 0)
     {
-        return -errno;
+        memcpy(value, job->buf, res);
     }
+    job_put(job);
     return res;
 }
 
@@ -749,16 +5635,25 @@ static int callback_getxattr(const char *path, const char *name, char *value, si
 static int callback_listxattr(const char *path, char *list, size_t size)
 {
     DEBUG("CALLLBACK_LISTXATTR %s", "sd");
-    int res;
-    char *ipath;
+    int errnum;
 
-    ipath = translate_path(path);
-    res = llistxattr(ipath, list, size);
-    free(ipath);
-    if (res == -1)
+    if (is_stats_path(path))
+    {
+        return 0;
+    }
+
+    request_begin();
+    backend_job *job = metadata_job(JOB_LISTXATTR, path, 0, NULL, size, &errnum);
+    if (job == NULL)
+    {
+        return -errnum;
+    }
+    int res = job->res == -1 ? -job->errnum : (int)job->res;
+    if (res > 0 && size > 0)
     {
-        return -errno;
+        memcpy(list, job->buf, res);
     }
+    job_put(job);
     return res;
 }
 
@@ -772,10 +5667,103 @@ static int callback_removexattr(const char *path, const char *name)
     return -EROFS;
 }
 
+// The callbacks as registered with FUSE, timed into the stats
+static int counted_getattr(const char *path, struct stat *st)
+{
+    long long start = stats_start();
+    int res = callback_getattr(path, st);
+    stats_op_done(OP_GETATTR, start, res);
+    return res;
+}
+
+static int counted_readlink(const char *path, char *buf, size_t size)
+{
+    long long start = stats_start();
+    int res = callback_readlink(path, buf, size);
+    stats_op_done(OP_READLINK, start, res);
+    return res;
+}
+
+static int counted_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    long long start = stats_start();
+    int res = callback_readdir(path, buf, filler, offset, fi);
+    stats_op_done(OP_READDIR, start, res);
+    return res;
+}
+
+static int counted_open(const char *path, struct fuse_file_info *finfo)
+{
+    long long start = stats_start();
+    int res = callback_open(path, finfo);
+    stats_op_done(OP_OPEN, start, res);
+    return res;
+}
+
+static int counted_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *finfo)
+{
+    long long start = stats_start();
+    int res = callback_read(path, buf, size, offset, finfo);
+    stats_op_done(OP_READ, start, res);
+    return res;
+}
+
+static int counted_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *finfo)
+{
+    long long start = stats_start();
+    int res = callback_read_buf(path, bufp, size, offset, finfo);
+    stats_op_done(OP_READ_BUF, start, res);
+    return res;
+}
+
+static int counted_release(const char *path, struct fuse_file_info *finfo)
+{
+    long long start = stats_start();
+    int res = callback_release(path, finfo);
+    stats_op_done(OP_RELEASE, start, res);
+    return res;
+}
+
+static int counted_statfs(const char *path, struct statvfs *st_buf)
+{
+    long long start = stats_start();
+    int res = callback_statfs(path, st_buf);
+    stats_op_done(OP_STATFS, start, res);
+    return res;
+}
+
+static int counted_access(const char *path, int mode)
+{
+    long long start = stats_start();
+    int res = callback_access(path, mode);
+    stats_op_done(OP_ACCESS, start, res);
+    return res;
+}
+
+static int counted_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    long long start = stats_start();
+    int res = callback_getxattr(path, name, value, size);
+    stats_op_done(OP_GETXATTR, start, res);
+    return res;
+}
+
+static int counted_listxattr(const char *path, char *list, size_t size)
+{
+    long long start = stats_start();
+    int res = callback_listxattr(path, list, size);
+    stats_op_done(OP_LISTXATTR, start, res);
+    return res;
+}
+
 struct fuse_operations callback_oper = {
-    .getattr = callback_getattr,
-    .readlink = callback_readlink,
-    .readdir = callback_readdir,
+    .init = callback_init,
+    .destroy = callback_destroy,
+    .getattr = counted_getattr,
+    .readlink = counted_readlink,
+    .opendir = callback_opendir,
+    .readdir = counted_readdir,
+    .releasedir = callback_releasedir,
     .mknod = callback_mknod,
     .mkdir = callback_mkdir,
     .symlink = callback_symlink,
@@ -787,19 +5775,25 @@ struct fuse_operations callback_oper = {
     .chown = callback_chown,
     .truncate = callback_truncate,
     .utime = callback_utime,
-    .open = callback_open,
-    .read = callback_read,
+    .open = counted_open,
+    .read = counted_read,
+    .read_buf = NULL, // counted_read_buf with -o zero_copy
     .write = callback_write,
-    .statfs = callback_statfs,
-    .release = callback_release,
+    .statfs = counted_statfs,
+    .release = counted_release,
     .fsync = callback_fsync,
-    .access = callback_access,
+    .access = counted_access,
 
     /* Extended attributes support for userland interaction */
     .setxattr = callback_setxattr,
-    .getxattr = callback_getxattr,
-    .listxattr = callback_listxattr,
-    .removexattr = callback_removexattr
+    .getxattr = counted_getxattr,
+    .listxattr = counted_listxattr,
+    .removexattr = callback_removexattr,
+
+    // read, read_buf, readdir and release find what they need in the file handle. Saves libfuse
+    // building the path for every one of them
+    .flag_nullpath_ok = 1,
+    .flag_nopath = 1
 
 };
 enum
@@ -813,16 +5807,58 @@ static void usage(const char *progname)
     fprintf(stdout,
             "usage: %s comma,separated,list,of,underlying-fss-paths mountpoint [options]\n"
             "\n"
-            "   Mounts paths as a read-only mount at mountpoint\n"
+            "   Mounts paths as a read-only mount at mountpoint. Each path may be followed by\n"
+            "   :priority or :priority:weight, like /a:1,/b:1,/c:2 (default 1:1). Lower priorities\n"
+            "   are tried first, higher ones only when those fail\n"
             "\n"
             "general options:\n"
             "   -o opt,[opt...]     mount options\n"
             "   -h  --help          print help\n"
             "   -V  --version       print version\n"
+            "\n"
+            "haread-fs options:\n"
+            "   -o hedge            send a slow read to the next replica as well, first answer wins\n"
+            "   -o hedge_delay=MS   wait MS milliseconds before hedging (default: p95 of recent reads)\n"
+            "   -o attr_cache_ttl=S          cache getattr results for S seconds (default: 1, 0 disables)\n"
+            "   -o attr_cache_negative_ttl=S remember missing paths for S seconds (default: 1)\n"
+            "   -o attr_cache_size=N         cache at most N paths (default: 100000)\n"
+            "   -o entry_timeout=S           kernel name lookup cache (default: attr_cache_ttl)\n"
+            "   -o attr_timeout=S            kernel attribute cache (default: attr_cache_ttl)\n"
+            "   -o negative_timeout=S        kernel negative lookup cache (default: attr_cache_negative_ttl)\n"
+            "   -o dir_cache_size=MB         cache directory listings, revalidated by mtime (default: 64, 0 disables)\n"
+            "   -o dir_cache_max_age=S       re-read a cached listing after S seconds even if unchanged (default: 60, 0 never)\n"
+            "   -o replica_policy=P          replica tried first within a priority: ordered (as given), ewma (lowest\n"
+            "                                latency / weight, default) or p2c (better of two drawn by weight, by latency and load)\n"
+            "   -o zero_copy                 let FUSE splice reads from a healthy pinned replica, without timeout or\n"
+            "                                readahead. Not with hedge, consistency or for files in cache_dir\n"
+            "   -o readahead=N               prefetch up to N chunks for sequential readers (default: 8, max 32, 0 disables)\n"
+            "   -o cache_dir=DIR             cache file blocks on local disk in DIR (default: no cache)\n"
+            "   -o cache_size=SIZE           size of the cache in cache_dir with a unit K, M, G or T, like 200G\n"
+            "   -o metadata_timeout=MS       give up on a replica's stat, readlink or xattr call after MS milliseconds, 1 to 3600000 (default: 5000)\n"
+            "   -o open_timeout=MS           same for open (default: 5000)\n"
+            "   -o read_timeout=MS           same for reading one chunk (default: 5000)\n"
+            "   -o readdir_timeout=MS        same for listing a directory on all replicas (default: 5000)\n"
+            "   -o request_timeout=MS        give up on a request after MS milliseconds, failovers included, up to 3600000\n"
+            "                                (default: 0, none)\n"
+            "   -o location_cache_size=N     remember which replicas hold up to N paths that some replica lacks (default: 100000, 0 disables)\n"
+            "   -o location_cache_ttl=S      for S seconds (default: 60)\n"
+            "   -o threads=N                 serve FUSE requests on N threads, up to 1024 (default: 0, as many as libfuse starts)\n"
+            "   -o max_inflight=N            calls queued or running per replica, more go to the next one (default: 0, no limit)\n"
+            "   -o readdir_stat              stat entries while listing a directory, for ls -l and find (default: off)\n"
+            "   -o io_engine=E               run backend calls on worker threads (threads, default) or io_uring (uring)\n"
+            "   -o log_sink=S                write the log to stdout (default) or the systemd journal (journald)\n"
+            "   -o consistency               compare a file's size and mtime on all replicas and read it from one copy.\n"
+            "                                Complete copies with the same size count as the same, contents are not compared\n"
+            "   -o consistency_settle=S      a copy not modified for S seconds is complete (default: 2)\n"
+            "   -o max_stuck=N               once N calls are stuck on all replicas, fail fast on those with one (default: 16, 0 no limit)\n"
+            "\n"
+            "   Counters are logged on SIGUSR1\n"
             "\n",
             progname);
 }
 
+static char *Fsarg = NULL; // The comma separated list of underlying paths
+
 static int hareadfs_parse_opt(void *data, const char *arg, int key,
                           struct fuse_args *outargs)
 {
@@ -831,9 +5867,9 @@ static int hareadfs_parse_opt(void *data, const char *arg, int key,
     switch (key)
     {
     case FUSE_OPT_KEY_NONOPT:
-        if (Currfs == 0)
+        if (Fsarg == NULL)
         {
-            Currfs = strdup(arg);
+            Fsarg = strdup(arg);
             return 0;
         }
         else
@@ -855,7 +5891,43 @@ static int hareadfs_parse_opt(void *data, const char *arg, int key,
     return 1;
 }
 
+#define HAREADFS_OPT(t, p, v) { t, offsetof(struct hareadfs_config, p), v }
+
 static struct fuse_opt hareadfs_opts[] = {
+    HAREADFS_OPT("hedge", hedge, 1),
+    HAREADFS_OPT("hedge_delay=%u", hedge_delay, 0),
+    HAREADFS_OPT("attr_cache_ttl=%lf", attr_cache_ttl, 0),
+    HAREADFS_OPT("attr_cache_negative_ttl=%lf", attr_cache_negative_ttl, 0),
+    HAREADFS_OPT("attr_cache_size=%u", attr_cache_size, 0),
+    // Recorded, and passed on to FUSE as well
+    HAREADFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    FUSE_OPT_KEY("entry_timeout=", FUSE_OPT_KEY_KEEP),
+    HAREADFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    FUSE_OPT_KEY("attr_timeout=", FUSE_OPT_KEY_KEEP),
+    HAREADFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+    FUSE_OPT_KEY("negative_timeout=", FUSE_OPT_KEY_KEEP),
+    HAREADFS_OPT("dir_cache_size=%u", dir_cache_size, 0),
+    HAREADFS_OPT("dir_cache_max_age=%lf", dir_cache_max_age, 0),
+    HAREADFS_OPT("replica_policy=%s", replica_policy, 0),
+    HAREADFS_OPT("zero_copy", zero_copy, 1),
+    HAREADFS_OPT("readahead=%u", readahead, 0),
+    HAREADFS_OPT("cache_dir=%s", cache_dir, 0),
+    HAREADFS_OPT("cache_size=%s", cache_size, 0),
+    HAREADFS_OPT("metadata_timeout=%u", metadata_timeout, 0),
+    HAREADFS_OPT("open_timeout=%u", open_timeout, 0),
+    HAREADFS_OPT("read_timeout=%u", read_timeout, 0),
+    HAREADFS_OPT("readdir_timeout=%u", readdir_timeout, 0),
+    HAREADFS_OPT("request_timeout=%u", request_timeout, 0),
+    HAREADFS_OPT("location_cache_size=%u", location_cache_size, 0),
+    HAREADFS_OPT("location_cache_ttl=%lf", location_cache_ttl, 0),
+    HAREADFS_OPT("threads=%u", threads, 0),
+    HAREADFS_OPT("max_inflight=%u", max_inflight, 0),
+    HAREADFS_OPT("readdir_stat", readdir_stat, 1),
+    HAREADFS_OPT("io_engine=%s", io_engine, 0),
+    HAREADFS_OPT("log_sink=%s", log_sink, 0),
+    HAREADFS_OPT("consistency", consistency, 1),
+    HAREADFS_OPT("consistency_settle=%lf", consistency_settle, 0),
+    HAREADFS_OPT("max_stuck=%u", max_stuck, 0),
     FUSE_OPT_KEY("-h", KEY_HELP),
     FUSE_OPT_KEY("--help", KEY_HELP),
     FUSE_OPT_KEY("-V", KEY_VERSION),
@@ -872,7 +5944,10 @@ void closedir_wrapper(void *dp) {
 void *thread_opendir_with_cleanup(void *arguments)
 {
     arg_struct_opendir *args = (arg_struct_opendir *)arguments;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     args->dp = opendir(args->path);
+    args->latency_us = elapsed_us(&start);
 
     if (args->dp == NULL)
     {
@@ -889,62 +5964,143 @@ void *thread_opendir_with_cleanup(void *arguments)
         pthread_cleanup_pop(1);
     }
 
+    pthread_mutex_lock(args->lock);
+    args->done = 1;
+    pthread_cond_broadcast(args->cond);
+    pthread_mutex_unlock(args->lock);
     return NULL;
 }
 
 
 
 
+static void request_counter_dump(int sig)
+{
+    (void)sig;
+    Dump_counters = 1;
+}
+
+static void log_counters(void)
+{
+    LOG("counters: read_hedges=%lu read_hedge_primary=%lu read_hedge_secondary=%lu attr_cache_hits=%lu attr_cache_misses=%lu "
+        "dir_cache_hits=%lu dir_cache_misses=%lu dir_cache_bytes=%zu location_hits=%lu location_misses=%lu location_stale=%lu "
+        "readdir_attrs=%lu uring_calls=%lu uring_cancels=%lu divergent_files=%lu divergent_reads=%lu "
+        "late_calls=%lu late_cached=%lu "
+        "zero_copy_reads=%lu copied_reads=%lu "
+        "prefetch_issued=%lu prefetch_hits=%lu prefetch_waste=%lu "
+        "block_cache_hits=%lu block_cache_misses=%lu block_cache_fills=%lu block_cache_evictions=%lu block_cache_bytes=%llu "
+        "failovers=%lu deadline_misses(metadata=%lu open=%lu read=%lu readdir=%lu request=%lu)\n",
+        counter_total(COUNTER(read_hedges)),
+        counter_total(COUNTER(read_hedge_primary)),
+        counter_total(COUNTER(read_hedge_secondary)),
+        counter_total(COUNTER(attr_cache_hits)),
+        counter_total(COUNTER(attr_cache_misses)),
+        counter_total(COUNTER(dir_cache_hits)),
+        counter_total(COUNTER(dir_cache_misses)),
+        __atomic_load_n(&DirCacheBytes, __ATOMIC_RELAXED),
+        counter_total(COUNTER(location_hits)),
+        counter_total(COUNTER(location_misses)),
+        counter_total(COUNTER(location_stale)),
+        counter_total(COUNTER(readdir_attrs)),
+        counter_total(COUNTER(uring_calls)),
+        counter_total(COUNTER(uring_cancels)),
+        counter_total(COUNTER(divergent_files)),
+        counter_total(COUNTER(divergent_reads)),
+        counter_total(COUNTER(late_calls)),
+        counter_total(COUNTER(late_cached)),
+        counter_total(COUNTER(zero_copy_reads)),
+        counter_total(COUNTER(copied_reads)),
+        counter_total(COUNTER(prefetch_issued)),
+        counter_total(COUNTER(prefetch_hits)),
+        counter_total(COUNTER(prefetch_waste)),
+        counter_total(COUNTER(block_cache_hits)),
+        counter_total(COUNTER(block_cache_misses)),
+        counter_total(COUNTER(block_cache_fills)),
+        counter_total(COUNTER(block_cache_evictions)),
+        __atomic_load_n(&BlockCacheBytes, __ATOMIC_RELAXED),
+        counter_total(COUNTER(failovers)),
+        counter_total(COUNTER(metadata_deadline_misses)),
+        counter_total(COUNTER(open_deadline_misses)),
+        counter_total(COUNTER(read_deadline_misses)),
+        counter_total(COUNTER(readdir_deadline_misses)),
+        counter_total(COUNTER(request_deadline_misses)));
+    for (int i = 0; i < Fscount; i++)
+    {
+        long long last_success = __atomic_load_n(&Health[i].last_success, __ATOMIC_RELAXED);
+        LOG("health: %s state=%d consecutive_failures=%d breaker_trips=%lu breaker_trials=%lu last_success_ms_ago=%lld latency_ewma_us=%u inflight=%d busy=%lu stuck=%d\n", Fss[i],
+            fs_state(i),
+            __atomic_load_n(&Health[i].consecutive_failures, __ATOMIC_RELAXED),
+            __atomic_load_n(&Health[i].trips, __ATOMIC_RELAXED),
+            __atomic_load_n(&Health[i].trials, __ATOMIC_RELAXED),
+            last_success ? monotonic_ms() - last_success : -1,
+            __atomic_load_n(&Health[i].latency_ewma, __ATOMIC_RELAXED),
+            __atomic_load_n(&Pools[i].inflight, __ATOMIC_RELAXED),
+            __atomic_load_n(&Pools[i].busy, __ATOMIC_RELAXED),
+            __atomic_load_n(&Pools[i].stuck, __ATOMIC_RELAXED));
+        pthread_mutex_lock(&Pools[i].stuck_lock);
+        for (GList *link = Pools[i].stuck_jobs.head; link != NULL; link = link->next)
+        {
+            backend_job *job = link->data;
+            LOG("stuck: %s %s %s for %ld ms\n", Fss[i], Job_names[job->type], job->path != NULL ? job->path : "(open file)",
+                elapsed_us(&job->submitted) / 1000);
+        }
+        pthread_mutex_unlock(&Pools[i].stuck_lock);
+    }
+}
+
+#define PROBE_INTERVAL 1 // Seconds between probes while the breaker is closed
+#define PROBE_TIMEOUT_MS 2000
+#define PROBE_SLOTS 5 // Probe threads per backend, stuck ones included
+
+// Probe the root of one backend: every PROBE_INTERVAL while it is up, and as the breaker's trial
+// while it is down. A probe that does not return within PROBE_TIMEOUT_MS is cancelled and keeps its
+// slot until the thread is gone, so a dead server ties up at most PROBE_SLOTS threads
 void *check_if_filesystem_blocks(void *fsno)
 {
-    pthread_t thread_ids[MAX_THREADS] = {0};
-    arg_struct_opendir args[MAX_THREADS]  = {0};
+    pthread_t thread_ids[PROBE_SLOTS] = {0};
+    arg_struct_opendir args[PROBE_SLOTS]  = {0};
     int current_thread = 0;
-    
-    int timed_out_last_iteration[MAX_FS] = {0};
+    pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t probe_done;
+
+    pthread_cond_init(&probe_done, &Job_condattr);
     while (1)
     {
         
         pthread_testcancel(); // Cancellation point
 
-        // Wait for the current thread to finish
+        if ((long)fsno == 0 && Dump_counters)
+        {
+            Dump_counters = 0;
+            log_counters();
+        }
+
+        int state = fs_state((long)fsno);
+        if (state != FS_OK && state != FS_UNKNOWN && !health_admit((long)fsno))
+        {
+            sleep(PROBE_INTERVAL);
+            continue;
+        }
+
+        // Reap the probe that was left in this slot, if it has returned by now
+        if (thread_ids[current_thread] != 0 && pthread_tryjoin_np(thread_ids[current_thread], NULL) == 0)
+        {
+            thread_ids[current_thread] = 0;
+        }
         if (thread_ids[current_thread] != 0)
         {
-            struct timespec timeout;
-            clock_gettime(CLOCK_REALTIME, &timeout);
-            timeout.tv_sec += 2;
-
-            if (pthread_timedjoin_np(thread_ids[current_thread], NULL, &timeout) != 0)
-            {
-                timed_out_last_iteration[(long)fsno]++;
-                LOG("Call to opendir(%s) timed out (%d times since last success)\n", Fss[(long)fsno],  timed_out_last_iteration[(long)fsno]);
-                pthread_cancel(thread_ids[current_thread]);
-                thread_ids[current_thread] = 0;
-                insert_to_hash_table(FSOkMap, args[current_thread].path, 0);
-               
-            } else {
-                if (timed_out_last_iteration[(long)fsno]) {
-                    LOG("check_if_filesystem_blocks: %s back online after timed out\n",  Fss[(long)fsno]);
-                    timed_out_last_iteration[(long)fsno] = 0;
-                }
-                
-                if (args[current_thread].res == 0 ) {
-                    insert_to_hash_table(FSOkMap, args[current_thread].path, 1);
-                } else {
-                    // Too many open files . But checking /proc/<pid>/fd/ only 4 file descriptors are used. So it something with
-                    // dirs are nfs mounts (I believe). Anyways, seems to work and seems to hook up when nfs server finally comes back up 
-                    if (EMFILE == args[current_thread].res ) {
-                        DEBUG("check_if_filesystem_blocks: Warning (Linux NFS client stuff? ) thread_opendir: %s\n", strerror(args[current_thread].res));
-                    } else {
-                        LOG("check_if_filesystem_blocks: Warning thread_opendir %s: %s\n", Fss[(long)fsno], strerror(args[current_thread].res));
-                    }
-                    insert_to_hash_table(FSOkMap, args[current_thread].path, 0);
-                }
-            }
+            // All slots hold a probe that is still stuck
+            health_probe_failed((long)fsno);
+            current_thread = (current_thread + 1) % PROBE_SLOTS;
+            sleep(PROBE_INTERVAL);
+            continue;
         }
 
         // Setup arguments for the new thread
         args[current_thread].path = Fss[(long)fsno];
+        args[current_thread].done = 0;
+        args[current_thread].lock = &probe_lock;
+        args[current_thread].cond = &probe_done;
 
         // Create a new thread to open the directory
         int ret = pthread_create(&thread_ids[current_thread], NULL, thread_opendir_with_cleanup, &args[current_thread]);
@@ -955,13 +6111,187 @@ void *check_if_filesystem_blocks(void *fsno)
             exit(1);
         }
 
-        // Move to the next thread
-        current_thread = (current_thread + 1) % MAX_THREADS;
+        // On CLOCK_MONOTONIC, unlike pthread_timedjoin_np, so a clock step can not fire or stall it
+        struct timespec timeout;
+        int rc = 0;
+        deadline_in(&timeout, PROBE_TIMEOUT_MS);
+        pthread_mutex_lock(&probe_lock);
+        while (!args[current_thread].done && rc == 0)
+        {
+            rc = pthread_cond_timedwait(&probe_done, &probe_lock, &timeout);
+        }
+        int done = args[current_thread].done;
+        pthread_mutex_unlock(&probe_lock);
+
+        if (!done)
+        {
+            DEBUG("Call to opendir(%s) timed out\n", Fss[(long)fsno]);
+            pthread_cancel(thread_ids[current_thread]);
+            health_probe_failed((long)fsno);
+            current_thread = (current_thread + 1) % PROBE_SLOTS; // Joined when we come back to it
+        }
+        else
+        {
+            pthread_join(thread_ids[current_thread], NULL);
+            thread_ids[current_thread] = 0;
+            if (args[current_thread].res == 0)
+            {
+                health_probe_ok((long)fsno, args[current_thread].latency_us);
+            }
+            else
+            {
+                // Too many open files . But checking /proc/<pid>/fd/ only 4 file descriptors are used. So it something with
+                // dirs are nfs mounts (I believe). Anyways, seems to work and seems to hook up when nfs server finally comes back up 
+                if (EMFILE == args[current_thread].res ) {
+                    DEBUG("check_if_filesystem_blocks: Warning (Linux NFS client stuff? ) thread_opendir: %s\n", strerror(args[current_thread].res));
+                } else {
+                    LOG("check_if_filesystem_blocks: Warning thread_opendir %s: %s\n", Fss[(long)fsno], strerror(args[current_thread].res));
+                }
+                health_probe_failed((long)fsno);
+            }
+        }
 
         pthread_testcancel(); // Cancellation point
-        sleep(1);
+        sleep(PROBE_INTERVAL);
+    }
+}
+
+
+/******************************
+ *
+ * FUSE request loop
+ *
+ * libfuse's multithreaded loop starts another thread whenever all of them are busy, so requests
+ * piling up on a slow replica keep adding threads. With -o threads=N a fixed set of N threads
+ * reads requests from the kernel instead, like libfuse's own loop does it but without growing.
+ * Requests wait in the kernel while all N are busy. Every backend call runs on the workers,
+ * bounded by the timeouts and max_inflight, so a hung replica can not hold on to all of them.
+ *
+ ******************************/
+
+#define FUSE_THREADS_MAX 1024
+
+#if FUSE_VERSION >= 29
+static sem_t Fuse_finished; // Posted by a request thread that stopped
+
+typedef struct fuse_thread
+{
+    pthread_t id;
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+} fuse_thread;
+
+void *fuse_request_thread(void *arg)
+{
+    fuse_thread *t = arg;
+    size_t bufsize = fuse_chan_bufsize(t->ch);
+    char *buf = malloc(bufsize);
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_cleanup_push(free, buf);
+    while (buf != NULL && !fuse_session_exited(t->se))
+    {
+        struct fuse_chan *ch = t->ch;
+        struct fuse_buf fbuf = {.mem = buf, .size = bufsize};
+
+        // Only cancelled while waiting for the kernel, never in the middle of a callback
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int res = fuse_session_receive_buf(t->se, &fbuf, &ch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+        {
+            continue;
+        }
+        if (res <= 0) // Unmounted, or the device failed
+        {
+            if (res < 0)
+            {
+                fuse_session_exit(t->se);
+            }
+            break;
+        }
+        __atomic_add_fetch(&Fuse_busy, 1, __ATOMIC_RELAXED);
+        fuse_session_process_buf(t->se, &fbuf, ch);
+        __atomic_sub_fetch(&Fuse_busy, 1, __ATOMIC_RELAXED);
+    }
+    pthread_cleanup_pop(1);
+    sem_post(&Fuse_finished);
+    return NULL;
+}
+
+// Mount and serve requests on Conf.threads threads until unmounted or signalled, like fuse_main()
+static int fuse_main_fixed(int argc, char *argv[], const struct fuse_operations *op)
+{
+    char *mountpoint;
+    int multithreaded;
+    int res = 0;
+
+    struct fuse *fuse = fuse_setup(argc, argv, op, sizeof(*op), &mountpoint, &multithreaded, NULL);
+    if (fuse == NULL)
+    {
+        return 1;
+    }
+    if (!multithreaded) // -s wins
+    {
+        res = fuse_loop(fuse);
+        fuse_teardown(fuse, mountpoint);
+        return res == -1 ? 1 : 0;
+    }
+
+    // Forgets cached inodes with -o remember, which fuse_loop_mt() would start as well
+    if (fuse_start_cleanup_thread(fuse) != 0)
+    {
+        fuse_teardown(fuse, mountpoint);
+        return 1;
     }
+    struct fuse_session *se = fuse_get_session(fuse);
+    fuse_thread threads[Conf.threads];
+    unsigned int started = 0;
+    sigset_t all, old;
+
+    sem_init(&Fuse_finished, 0, 0);
+    // Signals are for the main thread, which waits for them below
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (; started < Conf.threads; started++)
+    {
+        threads[started].se = se;
+        threads[started].ch = fuse_session_next_chan(se, NULL);
+        int rc = pthread_create(&threads[started].id, NULL, fuse_request_thread, &threads[started]);
+        if (rc != 0)
+        {
+            LOG("fuse_main_fixed: Could not start request thread %u: %s\n", started, strerror(rc));
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (started == 0)
+    {
+        res = -1;
+    }
+    // A signal handler only sets the exit flag, so look at it now and then as well
+    while (started > 0 && !fuse_session_exited(se))
+    {
+        struct timespec wait;
+        clock_gettime(CLOCK_REALTIME, &wait);
+        wait.tv_sec += 1;
+        if (sem_timedwait(&Fuse_finished, &wait) == 0)
+        {
+            break;
+        }
+    }
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_cancel(threads[i].id);
+        pthread_join(threads[i].id, NULL);
+    }
+    fuse_stop_cleanup_thread(fuse);
+    fuse_session_reset(se);
+    fuse_teardown(fuse, mountpoint);
+    return res == -1 ? 1 : 0;
 }
+#endif
 
 
 int main(int argc, char *argv[])
@@ -970,34 +6300,142 @@ int main(int argc, char *argv[])
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     int res;
 
-    FSOkMap = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-
-    res = fuse_opt_parse(&args, &Currfs, hareadfs_opts, hareadfs_parse_opt);
+    Conf.attr_cache_ttl = 1;
+    Conf.attr_cache_negative_ttl = 1;
+    Conf.attr_cache_size = 100000;
+    Conf.entry_timeout = -1;
+    Conf.attr_timeout = -1;
+    Conf.negative_timeout = -1;
+    Conf.dir_cache_size = 64;
+    Conf.dir_cache_max_age = 60;
+    Conf.readahead = READAHEAD_DEFAULT;
+    Conf.metadata_timeout = TIMEOUT_DEFAULT_MS;
+    Conf.open_timeout = TIMEOUT_DEFAULT_MS;
+    Conf.read_timeout = TIMEOUT_DEFAULT_MS;
+    Conf.readdir_timeout = TIMEOUT_DEFAULT_MS;
+    Conf.location_cache_size = 100000;
+    Conf.location_cache_ttl = 60;
+    Conf.consistency_settle = CONSISTENCY_SETTLE_DEFAULT;
+    Conf.max_stuck = MAX_STUCK_DEFAULT;
+
+    res = fuse_opt_parse(&args, &Conf, hareadfs_opts, hareadfs_parse_opt);
     if (res != 0)
     {
         fprintf(stderr, "Invalid arguments\n");
         fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
         exit(1);
     }
-    if (Currfs == 0)
+
+    if (Conf.readahead > READAHEAD_MAX)
+    {
+        Conf.readahead = READAHEAD_MAX;
+    }
+
+    if (Conf.threads > FUSE_THREADS_MAX)
+    {
+        fprintf(stderr, "threads=%u is too many, at most %d\n", Conf.threads, FUSE_THREADS_MAX);
+        fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
+        exit(1);
+    }
+
+    // A per call timeout of 0 would fail every call at once. Only request_timeout has a "none"
+    struct
+    {
+        const char *name;
+        unsigned int ms;
+        unsigned int min;
+    } timeouts[] = {{"metadata_timeout", Conf.metadata_timeout, 1}, {"open_timeout", Conf.open_timeout, 1},
+                    {"read_timeout", Conf.read_timeout, 1}, {"readdir_timeout", Conf.readdir_timeout, 1},
+                    {"request_timeout", Conf.request_timeout, 0}};
+    for (size_t k = 0; k < sizeof(timeouts) / sizeof(timeouts[0]); k++)
+    {
+        if (timeouts[k].ms < timeouts[k].min || timeouts[k].ms > TIMEOUT_MAX_MS)
+        {
+            fprintf(stderr, "%s=%u out of range, expected %u to %u milliseconds\n", timeouts[k].name,
+                    timeouts[k].ms, timeouts[k].min, TIMEOUT_MAX_MS);
+            fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    Conf.policy = parse_replica_policy(Conf.replica_policy);
+    if (Conf.policy == -1)
+    {
+        fprintf(stderr, "Unknown replica_policy %s\n", Conf.replica_policy);
+        fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
+        exit(1);
+    }
+    if (Conf.io_engine != NULL && strcmp(Conf.io_engine, "threads") != 0 && strcmp(Conf.io_engine, "uring") != 0)
+    {
+        fprintf(stderr, "Unknown io_engine %s\n", Conf.io_engine);
+        fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
+        exit(1);
+    }
+    if (Conf.log_sink != NULL && strcmp(Conf.log_sink, "stdout") != 0 && strcmp(Conf.log_sink, "journald") != 0)
+    {
+        fprintf(stderr, "Unknown log_sink %s\n", Conf.log_sink);
+        fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
+        exit(1);
+    }
+    start_log();
+
+    // Let the kernel cache as long as we do, unless told otherwise
+    char opt[64];
+    if (Conf.entry_timeout < 0)
+    {
+        snprintf(opt, sizeof(opt), "-oentry_timeout=%g", Conf.attr_cache_ttl);
+        fuse_opt_add_arg(&args, opt);
+    }
+    if (Conf.attr_timeout < 0)
+    {
+        snprintf(opt, sizeof(opt), "-oattr_timeout=%g", Conf.attr_cache_ttl);
+        fuse_opt_add_arg(&args, opt);
+    }
+    if (Conf.negative_timeout < 0)
+    {
+        snprintf(opt, sizeof(opt), "-onegative_timeout=%g", Conf.attr_cache_negative_ttl);
+        fuse_opt_add_arg(&args, opt);
+    }
+    if (Fsarg == NULL)
     {
         fprintf(stderr, "Missing path\n");
         fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
         exit(1);
     }
-    Fss = split_string(argv[1], ",");
-    Currfs = Fss[0];
+    Fss = split_string(Fsarg, ",");
 
     int i;
     for (i = 0; *(Fss + i); i++)
     {
         Fscount++;
     }
+    int bad = parse_fss_specs();
+    if (bad != -1)
+    {
+        fprintf(stderr, "Bad replica '%s', expected path[:priority[:weight]] with a weight above 0\n", Fss[bad]);
+        exit(1);
+    }
+    normalize_fss();
 
     // "Remove" first command line arg
     argc--;
     argv++;
     
+    if (Conf.zero_copy)
+    {
+        callback_oper.read_buf = counted_read_buf;
+    }
+
+    start_stats();
+    start_health();
+    start_backend_pools();
+    start_uring();
+    start_attr_cache();
+    start_location_index();
+    start_dir_cache();
+    start_block_cache();
+    signal(SIGUSR1, request_counter_dump);
+
     // Monitor file systems . Does it block ?
     int rc;
     long t;
@@ -1012,7 +6450,16 @@ int main(int argc, char *argv[])
         }
     }
 
-#if FUSE_VERSION >= 26
+#if FUSE_VERSION >= 29
+    if (Conf.threads > 0)
+    {
+        fuse_main_fixed(args.argc, args.argv, &callback_oper);
+    }
+    else
+    {
+        fuse_main(args.argc, args.argv, &callback_oper, NULL);
+    }
+#elif FUSE_VERSION >= 26
     fuse_main(args.argc, args.argv, &callback_oper, NULL);
 #else
     fuse_main(args.argc, args.argv, &callback_oper);
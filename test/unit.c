@@ -0,0 +1,274 @@
+// Unit tests for the parts of haread-fs that need no mount and no backend: option parsing, the
+// latency histogram, the circuit breaker, replica selection and the location index.
+// Build and run with `make check`
+#define main haread_main
+#include "../haread-fs.c"
+#undef main
+
+static int Failures;
+
+#define EXPECT(cond)                                                          \
+    do                                                                        \
+    {                                                                         \
+        if (!(cond))                                                          \
+        {                                                                     \
+            fprintf(stderr, "%s:%d: %s: failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+            Failures++;                                                       \
+        }                                                                     \
+    } while (0)
+
+// Set up Fss, Fsprio, Fsweight and Fslen from specs like "/a:1:2"
+static void set_replicas(const char *specs)
+{
+    static char buf[256];
+    snprintf(buf, sizeof(buf), "%s", specs);
+    Fss = split_string(buf, ",");
+    for (Fscount = 0; Fss[Fscount] != NULL; Fscount++)
+    {
+        ;
+    }
+    if (parse_fss_specs() != -1)
+    {
+        fprintf(stderr, "set_replicas: bad specs %s\n", specs);
+        exit(1);
+    }
+    normalize_fss();
+}
+
+static int bad_spec(const char *specs)
+{
+    static char buf[256];
+    snprintf(buf, sizeof(buf), "%s", specs);
+    Fss = split_string(buf, ",");
+    for (Fscount = 0; Fss[Fscount] != NULL; Fscount++)
+    {
+        ;
+    }
+    return parse_fss_specs();
+}
+
+static void test_parse_fss_specs(void)
+{
+    set_replicas("/a,/b:2,/c:3:4,/d/");
+    EXPECT(Fscount == 4);
+    EXPECT(strcmp(Fss[0], "/a") == 0 && Fsprio[0] == 1 && Fsweight[0] == 1);
+    EXPECT(strcmp(Fss[1], "/b") == 0 && Fsprio[1] == 2 && Fsweight[1] == 1);
+    EXPECT(strcmp(Fss[2], "/c") == 0 && Fsprio[2] == 3 && Fsweight[2] == 4);
+    EXPECT(Fslen[3] == 2);
+
+    // Only numbers are split off, a colon in the path stays
+    set_replicas("/mnt/site:a,/x:1:");
+    EXPECT(strcmp(Fss[0], "/mnt/site:a") == 0 && Fsprio[0] == 1);
+    EXPECT(strcmp(Fss[1], "/x:1:") == 0 && Fsprio[1] == 1);
+
+    EXPECT(bad_spec("/a,/b:1:0") == 1);
+    EXPECT(bad_spec(":1,/b") == 0);
+    EXPECT(bad_spec("/a:1:2,/b:3") == -1);
+}
+
+static void test_parse_size(void)
+{
+    EXPECT(parse_size("200G") == 200ULL << 30);
+    EXPECT(parse_size("1t") == 1ULL << 40);
+    EXPECT(parse_size("3M") == 3ULL << 20);
+    EXPECT(parse_size("64k") == 64ULL << 10);
+    EXPECT(parse_size("200") == 0);
+    EXPECT(parse_size("200GB") == 0);
+    EXPECT(parse_size("G") == 0);
+    EXPECT(parse_size("") == 0);
+}
+
+static void test_hist_bucket(void)
+{
+    int last = -1;
+
+    for (unsigned long long us = 0; us < 100000; us++)
+    {
+        int bucket = hist_bucket(us);
+        EXPECT(bucket == last || bucket == last + 1);
+        EXPECT(us < hist_bucket_upper(bucket));
+        EXPECT(bucket == 0 || us >= hist_bucket_upper(bucket - 1));
+        last = bucket;
+        if (Failures > 0)
+        {
+            return;
+        }
+    }
+    EXPECT(hist_bucket(0) == 0);
+    EXPECT(hist_bucket(HIST_SUB - 1) == HIST_SUB - 1);
+    EXPECT(hist_bucket(1ULL << HIST_MAX_MSB) < HIST_BUCKETS);
+    EXPECT(hist_bucket(~0ULL) == HIST_BUCKETS - 1);
+}
+
+static void test_breaker(void)
+{
+    set_replicas("/a,/b");
+    start_health();
+
+    EXPECT(fs_state(0) == FS_UNKNOWN && !fs_blocks(0));
+    EXPECT(health_admit(0));
+    health_success(0);
+    EXPECT(fs_state(0) == FS_OK);
+
+    // A failure opens the breaker and turns calls away until retry_at
+    health_failure(0);
+    EXPECT(fs_state(0) == FS_BLOCKS && fs_blocks(0));
+    EXPECT(Health[0].backoff_ms == BREAKER_BACKOFF_MIN_MS);
+    EXPECT(!health_admit(0));
+
+    // Then exactly one caller gets through as the trial
+    Health[0].retry_at = 0;
+    EXPECT(health_admit(0));
+    EXPECT(fs_state(0) == FS_HALF_OPEN && fs_blocks(0));
+    EXPECT(!health_admit(0));
+    EXPECT(Health[0].trials == 1);
+
+    // A failed trial opens it for twice as long
+    health_failure(0);
+    EXPECT(fs_state(0) == FS_BLOCKS);
+    EXPECT(Health[0].backoff_ms == 2 * BREAKER_BACKOFF_MIN_MS);
+    for (int i = 0; i < 20; i++)
+    {
+        Health[0].retry_at = 0;
+        EXPECT(health_admit(0));
+        health_failure(0);
+    }
+    EXPECT(Health[0].backoff_ms == BREAKER_BACKOFF_MAX_MS);
+
+    // A successful trial closes it and resets the backoff
+    Health[0].retry_at = 0;
+    EXPECT(health_admit(0));
+    health_success(0);
+    EXPECT(fs_state(0) == FS_OK && Health[0].consecutive_failures == 0);
+    EXPECT(Health[0].backoff_ms == BREAKER_BACKOFF_MIN_MS);
+    EXPECT(fs_state(1) == FS_UNKNOWN);
+}
+
+static void test_replica_order(void)
+{
+    int order[4];
+
+    set_replicas("/a:2,/b:1,/c:1,/d:3");
+    start_health();
+    if (posix_memalign((void **)&Pools, 64, Fscount * sizeof(backend_pool)) != 0)
+    {
+        exit(1);
+    }
+    memset(Pools, 0, Fscount * sizeof(backend_pool));
+
+    Conf.policy = POLICY_ORDERED;
+    replica_order(order);
+    EXPECT(order[0] == 1 && order[1] == 2 && order[2] == 0 && order[3] == 3);
+
+    Conf.policy = POLICY_EWMA;
+    Health[1].latency_ewma = 5000;
+    Health[2].latency_ewma = 100;
+    replica_order(order);
+    EXPECT(order[0] == 2 && order[1] == 1 && order[2] == 0 && order[3] == 3);
+    EXPECT(preferred_replica() == 2);
+
+    // A blocked replica goes last, whatever its tier
+    Health[2].state = FS_BLOCKS;
+    replica_order(order);
+    EXPECT(order[0] == 1 && order[3] == 2);
+    Health[1].state = FS_HALF_OPEN;
+    EXPECT(preferred_replica() == 0);
+
+    // All blocked: still by tier and cost
+    Health[0].state = FS_BLOCKS;
+    Health[3].state = FS_BLOCKS;
+    replica_order(order);
+    EXPECT(order[0] == 2 && order[1] == 1 && order[2] == 0 && order[3] == 3);
+
+    // p2c only draws from the best tier that is up
+    set_replicas("/a:2,/b:1,/c:1,/d:1");
+    start_health();
+    Conf.policy = POLICY_P2C;
+    Health[3].state = FS_BLOCKS;
+    for (int i = 0; i < 1000; i++)
+    {
+        replica_order(order);
+        EXPECT(order[0] == 1 || order[0] == 2);
+        EXPECT(order[2] == 0 && order[3] == 3);
+    }
+}
+
+static dir_entry *new_entry(const char *name)
+{
+    dir_entry *entry = calloc(1, sizeof(dir_entry) + strlen(name) + 1);
+    strcpy(entry->name, name);
+    return entry;
+}
+
+static void test_location_index(void)
+{
+    int order[3];
+    unsigned long missing[1] = {0};
+
+    set_replicas("/a,/b,/c");
+    Conf.location_cache_size = 2;
+    Conf.location_cache_ttl = 60;
+    start_location_index();
+
+    order[0] = 0, order[1] = 1, order[2] = 2;
+    EXPECT(location_order("/f", order) == 0);
+
+    // /f is on c and not on a
+    LOC_SET(missing, 0);
+    location_store("/f", 2, missing);
+    EXPECT(location_order("/f", order) == 1);
+    EXPECT(order[0] == 2 && order[1] == 1 && order[2] == 0);
+
+    location_forget("/f");
+    order[0] = 0, order[1] = 1, order[2] = 2;
+    EXPECT(location_order("/f", order) == 0);
+    EXPECT(order[0] == 0 && order[1] == 1 && order[2] == 2);
+
+    // Bounded by location_cache_size, the least recently used entry goes
+    missing[0] = 0;
+    location_store("/x", 1, missing);
+    location_store("/y", 1, missing);
+    EXPECT(location_order("/x", order) == 1);
+    location_store("/z", 1, missing);
+    EXPECT(g_hash_table_size(LocationIndex) == 2);
+    EXPECT(g_hash_table_lookup(LocationIndex, "/y") == NULL);
+
+    // Expired entries are not used
+    location_entry *entry = g_hash_table_lookup(LocationIndex, "/z");
+    entry->expires = 0;
+    EXPECT(location_order("/z", order) == 0);
+
+    // From listings: a name on some replicas only is stored, one on all of them is not
+    GPtrArray *a = g_ptr_array_new_with_free_func(dir_entry_free);
+    GPtrArray *b = g_ptr_array_new_with_free_func(dir_entry_free);
+    g_ptr_array_add(a, new_entry("old"));
+    g_ptr_array_add(b, new_entry("old"));
+    g_ptr_array_add(b, new_entry("new"));
+    GPtrArray *listed[3] = {a, b, NULL};
+    Conf.location_cache_size = 10;
+    location_learn_listing("/dir/", listed);
+    order[0] = 0, order[1] = 1, order[2] = 2;
+    EXPECT(location_order("/dir/new", order) == 1);
+    EXPECT(order[0] == 1 && order[1] == 2 && order[2] == 0);
+    EXPECT(g_hash_table_lookup(LocationIndex, "/dir/old") == NULL);
+    g_ptr_array_free(a, TRUE);
+    g_ptr_array_free(b, TRUE);
+}
+
+int main(void)
+{
+    start_stats();
+    test_parse_fss_specs();
+    test_parse_size();
+    test_hist_bucket();
+    test_breaker();
+    test_replica_order();
+    test_location_index();
+    if (Failures > 0)
+    {
+        fprintf(stderr, "%d failed\n", Failures);
+        return 1;
+    }
+    printf("All passed\n");
+    return 0;
+}